@@ -0,0 +1,177 @@
+/* comic-viewer-bench.c
+ *
+ * Microbenchmarks for the comic-viewer pixel path (see pixel.h).
+ *
+ * This times farbfeld row conversion, and scaling, clipping (across and down)
+ * and storing rows in each display format, across a range of image widths
+ * and scale factors.
+ * Results are printed one per line as ns/pixel and GB/s (of input data), so
+ * they can be compared between runs.
+ *
+ * Author:  Alastair Hughes
+ * Contact: hobbitalastair at yandex dot com
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <libnsfb.h>
+
+#include "pixel.h"
+
+#define ROWS 256 /* Rows per benchmark pass */
+#define MIN_TIME 0.2 /* Minimum seconds to run each benchmark for */
+#define DISPLAY_WIDTH 1024 /* Width of the pretend display */
+
+char* name = __FILE__;
+
+/* Widths and scale factors to test; 0 terminated */
+uint32_t widths[] = {320, 800, 1000, 1600, 0};
+float scales[] = {1, 1 / 0.7, 2, 0};
+
+struct {
+    enum nsfb_format_e format;
+    char* name;
+} formats[] = {
+    {NSFB_FMT_RGB888, "RGB888"},
+    {NSFB_FMT_XRGB8888, "XRGB8888"},
+    {NSFB_FMT_XBGR8888, "XBGR8888"},
+    {NSFB_FMT_ANY, NULL},
+};
+
+/* Stops the compiler from optimising the work away */
+volatile uint8_t sink;
+
+double now(void) {
+    /* Return the current (monotonic) time in seconds */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report(char* kernel, char* format, uint32_t width, float scale,
+        double seconds, size_t pixels, size_t bytes) {
+    printf("%-10s %-9s width %5u scale %4.2f: %7.3f ns/pixel %7.3f GB/s\n",
+            kernel, format, width, scale, seconds * 1e9 / pixels,
+            bytes / seconds / 1e9);
+}
+
+void bench_convert(uint8_t* farbfeld, uint8_t* rgbx, uint32_t width) {
+    /* Time converting farbfeld rows to RGBX */
+    size_t passes = 0;
+    double start = now();
+    double elapsed;
+    do {
+        for (int y = 0; y < ROWS; y++) {
+            farbfeld_to_rgbx(farbfeld + (size_t)y * width * 8,
+                    rgbx + (size_t)y * width * 4, width);
+        }
+        sink = rgbx[passes % ((size_t)width * ROWS * 4)];
+        passes++;
+        elapsed = now() - start;
+    } while (elapsed < MIN_TIME);
+
+    size_t pixels = passes * ROWS * width;
+    report("convert", "-", width, 1, elapsed, pixels, pixels * 8);
+}
+
+void bench_store(uint8_t* rgbx, uint8_t* display, uint32_t width,
+        float scale, int offset_x, int format) {
+    /* Time scaling, clipping and storing RGBX rows in the given format */
+    size_t passes = 0;
+    double start = now();
+    double elapsed;
+    do {
+        for (int y = 0; y < ROWS; y++) {
+            store_row(display + (size_t)y * DISPLAY_WIDTH * 4,
+                    formats[format].format, rgbx + (size_t)y * width * 4,
+                    width, scale, offset_x, DISPLAY_WIDTH);
+        }
+        sink = display[passes % ((size_t)DISPLAY_WIDTH * ROWS * 4)];
+        passes++;
+        elapsed = now() - start;
+    } while (elapsed < MIN_TIME);
+
+    /* Count source pixels, since that is what the viewer is fed */
+    size_t pixels = passes * ROWS * width;
+    report(offset_x == 0 ? "store" : "store+clip", formats[format].name,
+            width, scale, elapsed, pixels, pixels * 4);
+}
+
+void bench_vclip(uint8_t* farbfeld, uint8_t* rgbx, uint8_t* display,
+        uint32_t width, int format) {
+    /* Time converting and storing farbfeld rows when the image is scrolled
+     * halfway up the screen, so the first half of the rows are above the
+     * clip rows; this is what render_farbfeld does with a helper's output.
+     */
+    int clip_top = ROWS / 2;
+    size_t passes = 0;
+    double start = now();
+    double elapsed;
+    do {
+        for (int y = 0; y < ROWS; y++) {
+            int display_y = scale_to_display(y, 1, 0);
+            if (!row_visible(display_y, clip_top, ROWS)) continue;
+            farbfeld_to_rgbx(farbfeld + (size_t)y * width * 8, rgbx, width);
+            store_row(display + (size_t)display_y * DISPLAY_WIDTH * 4,
+                    formats[format].format, rgbx, width, 1, 0,
+                    DISPLAY_WIDTH);
+        }
+        sink = display[passes % ((size_t)DISPLAY_WIDTH * ROWS * 4)];
+        passes++;
+        elapsed = now() - start;
+    } while (elapsed < MIN_TIME);
+
+    /* Count every row we were fed, clipped or not */
+    size_t pixels = passes * ROWS * width;
+    report("vclip", formats[format].name, width, 1, elapsed, pixels,
+            pixels * 8);
+}
+
+int main(int argc, char** argv) {
+    if (argc > 0) name = argv[0];
+    if (argc != 1) {
+        fprintf(stderr, "usage: %s\n", name);
+        return EXIT_FAILURE;
+    }
+
+    uint32_t max_width = 0;
+    for (int i = 0; widths[i] != 0; i++) {
+        if (widths[i] > max_width) max_width = widths[i];
+    }
+    uint8_t* farbfeld = malloc((size_t)max_width * ROWS * 8);
+    uint8_t* rgbx = malloc((size_t)max_width * ROWS * 4);
+    uint8_t* display = malloc((size_t)DISPLAY_WIDTH * ROWS * 4);
+    if (farbfeld == NULL || rgbx == NULL || display == NULL) {
+        fprintf(stderr, "%s: malloc(): %s\n", name, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < (size_t)max_width * ROWS * 8; i++) {
+        farbfeld[i] = i * 7;
+    }
+    memset(display, 0, (size_t)DISPLAY_WIDTH * ROWS * 4);
+
+    for (int w = 0; widths[w] != 0; w++) {
+        bench_convert(farbfeld, rgbx, widths[w]);
+    }
+    for (int f = 0; formats[f].name != NULL; f++) {
+        for (int w = 0; widths[w] != 0; w++) {
+            for (int s = 0; scales[s] != 0; s++) {
+                bench_store(rgbx, display, widths[w], scales[s], 0, f);
+            }
+            /* Scrolled halfway across, so half the row is clipped */
+            bench_store(rgbx, display, widths[w], 1, widths[w] / 2, f);
+            bench_vclip(farbfeld, rgbx, display, widths[w], f);
+        }
+    }
+
+    free(farbfeld);
+    free(rgbx);
+    free(display);
+    return EXIT_SUCCESS;
+}
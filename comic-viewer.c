@@ -2,10 +2,17 @@
  *
  * Experimental low-memory comic viewer.
  *
+ * Everything is drawn into an offscreen back buffer and then put on screen in
+ * one go, so partly drawn frames are never shown. Press "s" to toggle smooth
+ * scrolling, which animates each scroll at SMOOTH_FPS. That needs the
+ * DECODER_WORKER pool, since every frame draws the images at the edges again
+ * and without the pool that would mean decoding them all over again.
+ *
  * Author:  Alastair Hughes
  * Contact: hobbitalastair at yandex dot com
  */
 
+#define _GNU_SOURCE /* For memfd_create and pipe2 */
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -13,15 +20,23 @@
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #include <libnsfb.h>
 #include <libnsfb_event.h>
 #include <libnsfb_plot.h>
 
+#include "manifest.h"
+#include "memstat.h"
+#include "pixel.h"
+
 #define SURFACE_TYPE NSFB_SURFACE_SDL /* Default surface type */
 #define BACKGROUND_COLOUR 0xFF000000 /* Black (ABGR) */
 #define ERROR_COLOUR 0xFF0000FF /* Bright red (ABGR) */
@@ -31,6 +46,18 @@
 #define FALLBACK_HEIGHT 200 /* Height for images which failed to load */
 #define SCALE_FACTOR 0.7 /* Scale factor used for +/- scaling (<1) */
 #define TO_FARBFELD "/usr/bin/2ff" /* Helper program to convert to farbfeld */
+#define SHM_HELPER "/usr/bin/decoder-shm" /* TO_FARBFELD, but with the ring */
+#define SHM_MAGIC "farbshm" /* Header magic for the shared memory protocol */
+#define SHM_FD 3 /* Helper fd for the shared ring buffer */
+#define SHM_FD_STRING "3"
+#define ACK_FD 4 /* Helper fd for reading acknowledgements */
+#define ACK_FD_STRING "4"
+#define SHM_MAX_SIZE (4 * 1024 * 1024) /* Largest ring buffer we will map */
+#define DECODER_WORKER "/usr/bin/decoder-worker" /* Persistent decoder */
+#define POOL_MAGIC "farbpool" /* Header magic for decoder worker replies */
+#define POOL_SIZE 2 /* Maximum number of decoder workers */
+#define SMOOTH_FPS 60 /* Target frame rate for smooth scrolling */
+#define SMOOTH_TIME 0.15 /* Seconds to animate each smooth scroll over */
 
 
 typedef struct {
@@ -45,15 +72,52 @@ typedef struct {
     int width;
     int height;
 
-    /* Display format, buffer and stride */
+    /* Display format, and the back buffer we draw into and its stride */
     enum nsfb_format_e format;
     uint8_t* buf;
     int stride;
 
-    /* Shared libnsfb context */
+    /* Rows of the back buffer currently being drawn; anything plotted
+     * outside of them is dropped.
+     */
+    int clip_top;
+    int clip_bottom;
+
+    /* What is in the back buffer, so that we can reuse it when scrolling */
+    bool drawn; /* False if it needs redrawing from scratch */
+    int drawn_y;
+    int drawn_x;
+    float drawn_scale;
+
+    /* Smooth scrolling state */
+    bool smooth; /* Whether smooth scrolling is turned on */
+    bool scrolling; /* Whether we are part way through a scroll */
+    int scroll_from; /* Offset the current scroll started at */
+    int scroll_to; /* Offset the current scroll ends at */
+    double scroll_start; /* Time the current scroll started */
+    double next_frame; /* Time the next frame is due */
+
+    /* Shared libnsfb context, and the (on screen) buffer and stride */
     nsfb_t *nsfb;
+    uint8_t* screen;
+    int screen_stride;
 } display_t;
 
+typedef struct {
+    /* A long lived decoder worker (see render_pooled) */
+    pid_t pid; /* Worker pid, or 0 if not running */
+    int to; /* Pipe to the worker's stdin */
+    int from; /* Pipe from the worker's stdout */
+    int image; /* Image it was last given, or -1 */
+    unsigned long used; /* Value of pool_clock when it was last given one */
+} worker_t;
+
+typedef enum {
+    POOL_OK, /* Rendered */
+    POOL_FAILED, /* The image couldn't be rendered */
+    POOL_UNAVAILABLE, /* The pool can't be used, fall back to TO_FARBFELD */
+} pool_result_t;
+
 typedef struct {
     /* Information needed for rendering the images onto the display */
 
@@ -69,9 +133,32 @@ typedef struct {
      * pixel is *very* expensive.
      */
     unsigned char readbuf[READ_BUF_SIZE];
+
+    /* Decoder worker pool, and whether it is missing or we gave up on it */
+    worker_t workers[POOL_SIZE];
+    unsigned long pool_clock; /* Number of requests given to the pool */
+    bool pool_disabled;
+
+    /* Whether SHM_HELPER is installed, so that the ring is worth setting up */
+    bool shm_helper;
 } content_t;
 
 
+void allocate_back_buffer(char* name, display_t *d) {
+    /* (Re)allocate the back buffer to match the screen.
+     *
+     * This exits on failure.
+     */
+    free(d->buf);
+    d->stride = d->screen_stride;
+    d->buf = calloc(d->height, d->stride);
+    if (d->buf == NULL && d->height != 0) {
+        fprintf(stderr, "%s: calloc(): %s\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    d->drawn = false;
+}
+
 void initialise_display(char* name, display_t *d) {
     /* Initialise the given display struct.
      *
@@ -81,7 +168,11 @@ void initialise_display(char* name, display_t *d) {
     d->offset_y = 0;
     d->offset_x = 0;
     d->scale_factor = 1;
+    d->buf = NULL;
+    d->smooth = false;
+    d->scrolling = false;
 
+    mem_subsystem_t previous = memstat_enter(MEM_FRAMEBUFFER);
     d->nsfb = nsfb_new(SURFACE_TYPE);
     if (d->nsfb == NULL || nsfb_init(d->nsfb) != 0) {
         fprintf(stderr, "%s: failed to initialise libnsfb\n", name);
@@ -92,10 +183,12 @@ void initialise_display(char* name, display_t *d) {
         fprintf(stderr, "%s: failed to get window geometry\n", name);
         exit(EXIT_FAILURE);
     }
-    if (nsfb_get_buffer(d->nsfb, &d->buf, &d->stride) != 0) {
+    if (nsfb_get_buffer(d->nsfb, &d->screen, &d->screen_stride) != 0) {
         fprintf(stderr, "%s: failed to get window buffer\n", name);
         exit(EXIT_FAILURE);
     }
+    allocate_back_buffer(name, d);
+    memstat_leave(previous);
 }
 
 void resize_display(char* name, display_t *d, int width, int height) {
@@ -104,8 +197,10 @@ void resize_display(char* name, display_t *d, int width, int height) {
      * This (may) call exit on failure.
      */
 
+    mem_subsystem_t previous = memstat_enter(MEM_FRAMEBUFFER);
     if (nsfb_set_geometry(d->nsfb, width, height, NSFB_FMT_ANY) != 0) {
         fprintf(stderr, "%s: failed to resize window region\n", name);
+        memstat_leave(previous);
         return;
     }
 
@@ -113,10 +208,65 @@ void resize_display(char* name, display_t *d, int width, int height) {
         fprintf(stderr, "%s: failed to get window geometry\n", name);
         exit(EXIT_FAILURE);
     }
-    if (nsfb_get_buffer(d->nsfb, &d->buf, &d->stride) != 0) {
+    if (nsfb_get_buffer(d->nsfb, &d->screen, &d->screen_stride) != 0) {
         fprintf(stderr, "%s: failed to get window buffer\n", name);
         exit(EXIT_FAILURE);
     }
+    allocate_back_buffer(name, d);
+    memstat_leave(previous);
+}
+
+void load_manifests(content_t *content) {
+    /* Fill in the image sizes from the chapter manifests, where there are
+     * any, so the layout is known before decoding anything. Transcoded
+     * copies are listed in a manifest of their own.
+     *
+     * Entries are only used if the file size still matches.
+     *
+     * Each directory's manifests are read once, when we get to its first
+     * image.
+     */
+    manifest_t manifest = {NULL, 0};
+    manifest_t derived = {NULL, 0};
+    char dir[PATH_MAX] = "";
+    char manifest_path[PATH_MAX + sizeof(MANIFEST_FF_NAME) + 1];
+
+    for (int i = 0; i < content->image_count; i++) {
+        /* Split the image path into the directory and file name */
+        char* image = content->images[i];
+        char* slash = strrchr(image, '/');
+        char* file = slash == NULL ? image : slash + 1;
+        int dir_len = slash == NULL ? 1 : slash - image;
+        char* dir_name = slash == NULL ? "." : image;
+        if (dir_len >= PATH_MAX) continue;
+
+        if ((int)strlen(dir) != dir_len ||
+                strncmp(dir, dir_name, dir_len) != 0) {
+            manifest_free(&manifest);
+            manifest_free(&derived);
+            snprintf(dir, sizeof(dir), "%.*s", dir_len, dir_name);
+            snprintf(manifest_path, sizeof(manifest_path), "%s/%s", dir,
+                    MANIFEST_NAME);
+            manifest_load(manifest_path, &manifest);
+            snprintf(manifest_path, sizeof(manifest_path), "%s/%s", dir,
+                    MANIFEST_FF_NAME);
+            manifest_load(manifest_path, &derived);
+        }
+
+        manifest_entry_t* entry = manifest_find(&manifest, file);
+        if (entry == NULL) entry = manifest_find(&derived, file);
+        struct stat st;
+        if (entry == NULL || stat(image, &st) == -1 ||
+                (uint64_t)st.st_size != entry->bytes) {
+            continue;
+        }
+        content->heights[i] = entry->height;
+        if (content->max_width < entry->width) {
+            content->max_width = entry->width;
+        }
+    }
+    manifest_free(&manifest);
+    manifest_free(&derived);
 }
 
 void initialise_content(char* name, content_t *content,
@@ -129,14 +279,363 @@ void initialise_content(char* name, content_t *content,
     content->image_count = image_count;
     content->images = images;
 
+    mem_subsystem_t previous = memstat_enter(MEM_CACHE);
     content->heights = calloc(image_count, sizeof(unsigned int));
     if (content->heights == NULL) {
         fprintf(stderr, "%s: calloc(): %s\n", name, strerror(errno));
         exit(EXIT_FAILURE);
     }
     content->max_width = 0;
+    for (int i = 0; i < POOL_SIZE; i++) {
+        content->workers[i].pid = 0;
+        content->workers[i].image = -1;
+        content->workers[i].used = 0;
+    }
+    content->pool_clock = 0;
+    content->pool_disabled = access(DECODER_WORKER, X_OK) != 0;
+    content->shm_helper = access(SHM_HELPER, X_OK) == 0;
+    load_manifests(content);
+    memstat_leave(previous);
+}
+
+
+void plot_row(display_t *d, const uint8_t *rgbx, uint32_t width,
+        float scale_factor, int display_y) {
+    /* Plot a row of 8 bit RGBX pixels onto the given display row, scaling it
+     * by the given factor.
+     *
+     * Because libnsfb doesn't provide a "set-pixel" function, we plot into
+     * the buffer directly. For this to work we need the buffer to be in one
+     * of the 32 bit formats store_row() knows about, and we have to be *very*
+     * careful not to draw outside the screen.
+     */
+    if (!row_visible(display_y, d->clip_top, d->clip_bottom)) return;
+    store_row(d->buf + display_y * d->stride, d->format, rgbx, width,
+            scale_factor, d->offset_x, d->width);
 }
 
+bool read_all(int fd, void *buf, size_t len) {
+    /* Read exactly len bytes, returning false on failure or early EOF */
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t count = read(fd, p, len);
+        if (count == -1 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        p += count;
+        len -= count;
+    }
+    return true;
+}
+
+void render_farbfeld(display_t *d, content_t *content, int fd,
+        uint32_t width, uint32_t height, uint32_t first, uint32_t end,
+        int offset, char* name, int img) {
+    /* Render plain (16 bit per channel) farbfeld data from the helper.
+     *
+     * The data starts at row "first", and we stop reading at row "end",
+     * unless that is the end of the image (in which case we keep reading so
+     * that the helper can finish writing).
+     *
+     * Each row is converted to 8 bit RGBX as it arrives, but only if it
+     * will actually be visible.
+     */
+    if (width == 0) return;
+    mem_subsystem_t previous = memstat_enter(MEM_CACHE);
+    uint8_t *row = malloc((size_t)width * 4);
+    memstat_leave(previous);
+    if (row == NULL) {
+        fprintf(stderr, "%s: malloc(): %s\n", name, strerror(errno));
+        return;
+    }
+
+    uint32_t x = 0; /* Current x position in the image */
+    uint32_t y = first; /* Current y position in the image */
+    size_t have = 0; /* Bytes in the read buffer */
+    while (y < end || end == height) {
+        ssize_t count = read(fd, content->readbuf + have,
+                sizeof(content->readbuf) - have);
+        if (count == -1 && errno == EINTR) continue;
+        if (count <= 0) break;
+        have += count;
+
+        /* Ignore any extra data from the helper past the declared size,
+         * but keep reading so that it can finish writing.
+         */
+        size_t pixels = have / 8;
+        size_t done = 0;
+        while (done < pixels && y < end) {
+            size_t n = width - x;
+            if (n > pixels - done) n = pixels - done;
+            int display_y = scale_to_display(y, d->scale_factor, -offset);
+            if (row_visible(display_y, d->clip_top, d->clip_bottom)) {
+                farbfeld_to_rgbx(content->readbuf + done * 8, row + x * 4, n);
+            }
+            x += n;
+            done += n;
+            if (x == width) {
+                plot_row(d, row, width, d->scale_factor, display_y);
+                x = 0;
+                y++;
+            }
+        }
+
+        /* Keep any partial pixel for the next read */
+        have -= pixels * 8;
+        memmove(content->readbuf, content->readbuf + pixels * 8, have);
+    }
+    if (y != end) {
+        fprintf(stderr, "%s: image %s seems corrupted\n", content->images[img],
+                name);
+    }
+    free(row);
+}
+
+void render_farbfeld_file(display_t *d, content_t *content, int fd,
+        uint32_t width, uint32_t height, int offset, char* name, int img) {
+    /* Render a farbfeld file, just after reading the header.
+     *
+     * Unlike a pipe we can seek, so only the rows which land within the clip
+     * rows are read.
+     */
+    float scale = d->scale_factor;
+    uint32_t first = 0;
+    if (d->clip_top > offset) first = (d->clip_top - offset) * scale;
+    if (first > height) first = height;
+    while (first > 0 &&
+            scale_to_display(first - 1, scale, -offset) >= d->clip_top) {
+        first--;
+    }
+    while (first < height &&
+            scale_to_display(first, scale, -offset) < d->clip_top) {
+        first++;
+    }
+    uint32_t end = first;
+    while (end < height &&
+            scale_to_display(end, scale, -offset) < d->clip_bottom) {
+        end++;
+    }
+    if (first == end) return;
+
+    if (lseek(fd, 16 + (off_t)first * width * 8, SEEK_SET) == -1) {
+        fprintf(stderr, "%s: lseek(%s): %s\n", name, content->images[img],
+                strerror(errno));
+        return;
+    }
+    render_farbfeld(d, content, fd, width, height, first, end, offset, name,
+            img);
+}
+
+void render_shm(display_t *d, content_t *content, int fd, int shm, int ack,
+        uint32_t width, uint32_t height, int offset, char* name, int img) {
+    /* Render 8 bit RGBX rows from the helper's shared ring buffer.
+     *
+     * The header has the magic "farbshm\0" rather than "farbfeld". After
+     * it, the helper sends the number of rows in the ring (having already
+     * sized the memfd to fit them with ftruncate). It then fills rows in
+     * (row "r" goes in slot "r % ring_rows") and sends the total number of
+     * rows written so far. We draw those rows straight
+     * out of the ring and reply with the total number of rows consumed, which
+     * tells the helper which slots it can reuse.
+     */
+    uint32_t ring_rows;
+    if (!read_all(fd, &ring_rows, sizeof(ring_rows))) {
+        fprintf(stderr, "%s: failed to read ring size\n", name);
+        return;
+    }
+    ring_rows = ntohl(ring_rows);
+    size_t row_size = (size_t)width * 4;
+    size_t ring_size = row_size * ring_rows;
+    struct stat shm_stat;
+    if (ring_rows == 0 || width == 0 || ring_size > SHM_MAX_SIZE ||
+            fstat(shm, &shm_stat) == -1 || shm_stat.st_size < ring_size) {
+        fprintf(stderr, "%s: bad ring buffer from helper\n", name);
+        return;
+    }
+    unsigned char *ring = mmap(NULL, ring_size, PROT_READ, MAP_SHARED, shm, 0);
+    if (ring == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap(): %s\n", name, strerror(errno));
+        return;
+    }
+
+    uint32_t consumed = 0;
+    while (consumed < height) {
+        uint32_t written;
+        if (!read_all(fd, &written, sizeof(written))) break;
+        written = ntohl(written);
+        if (written > height || written - consumed > ring_rows) {
+            fprintf(stderr, "%s: bad row count from helper\n", name);
+            break;
+        }
+
+        for (; consumed < written; consumed++) {
+            plot_row(d, ring + (consumed % ring_rows) * row_size, width,
+                    d->scale_factor,
+                    scale_to_display(consumed, d->scale_factor, -offset));
+        }
+
+        uint32_t reply = htonl(consumed);
+        if (write(ack, &reply, sizeof(reply)) != sizeof(reply)) break;
+    }
+    if (consumed != height) {
+        fprintf(stderr, "%s: image %s seems corrupted\n", name,
+                content->images[img]);
+    }
+    munmap(ring, ring_size);
+}
+
+bool start_worker(char* name, worker_t *w) {
+    /* Start a decoder worker, connected to us with a pair of pipes.
+     *
+     * Return false on failure, true on success.
+     */
+    int to_worker[2];
+    int from_worker[2];
+    if (pipe2(to_worker, O_CLOEXEC) == -1) return false;
+    if (pipe2(from_worker, O_CLOEXEC) == -1) {
+        close(to_worker[0]);
+        close(to_worker[1]);
+        return false;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, to_worker[0], 0);
+    posix_spawn_file_actions_adddup2(&actions, from_worker[1], 1);
+    char* argv[] = {DECODER_WORKER, NULL};
+    int err = posix_spawn(&w->pid, DECODER_WORKER, &actions, NULL, argv,
+            environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(to_worker[0]);
+    close(from_worker[1]);
+    if (err != 0) {
+        fprintf(stderr, "%s: posix_spawn(%s): %s\n", name, DECODER_WORKER,
+                strerror(err));
+        close(to_worker[1]);
+        close(from_worker[0]);
+        return false;
+    }
+    w->to = to_worker[1];
+    w->from = from_worker[0];
+    return true;
+}
+
+void stop_worker(worker_t *w) {
+    /* Stop the given worker, if it is running */
+    if (w->pid == 0) return;
+    close(w->to);
+    close(w->from);
+    kill(w->pid, SIGTERM);
+    waitpid(w->pid, NULL, 0);
+    w->pid = 0;
+    w->image = -1;
+}
+
+worker_t *pick_worker(content_t *content, int img) {
+    /* Find the worker to give the image to: the one which had it last, if
+     * any, and otherwise the one used least recently.
+     *
+     * Each worker only caches its last image, so this lets every image on
+     * the screen (up to POOL_SIZE of them) keep a worker to itself, even
+     * as we scroll from one image to the next.
+     */
+    worker_t *best = &content->workers[0];
+    for (int i = 0; i < POOL_SIZE; i++) {
+        worker_t *w = &content->workers[i];
+        if (w->image == img) return w;
+        if (w->used < best->used) best = w;
+    }
+    return best;
+}
+
+pool_result_t render_pooled(char* name, display_t *d, content_t *content,
+        int img, int offset) {
+    /* Render the given image using a worker from the decoder pool.
+     *
+     * Workers are long lived, and take requests on stdin of the form:
+     *
+     *     u32 path length, path, u32 first row, u32 last row, u32 scale
+     *
+     * where the rows are a half open range of rows in the scaled image, and
+     * the scale is the bits of our (float) scale factor, so that the worker
+     * scales exactly as we would. All numbers are big endian.
+     * The worker replies with the "farbpool" magic, the unscaled width and
+     * height, and then the scaled width and the number of rows it is sending,
+     * followed by those rows as 8 bit RGBX. A width and height of zero means
+     * the image couldn't be decoded.
+     *
+     * Images go back to the worker which had them last (see pick_worker),
+     * so a worker which caches its last image can avoid decoding it again.
+     *
+     * Returns POOL_UNAVAILABLE if the pool can't be used, in which case the
+     * caller should fall back to running TO_FARBFELD.
+     */
+    if (content->pool_disabled) return POOL_UNAVAILABLE;
+    worker_t *w = pick_worker(content, img);
+    if (w->pid == 0 && !start_worker(name, w)) {
+        content->pool_disabled = true;
+        return POOL_UNAVAILABLE;
+    }
+    w->image = img;
+    w->used = ++content->pool_clock;
+
+    /* We only need the rows which are actually being drawn */
+    uint32_t first = d->clip_top - offset > 0 ? d->clip_top - offset : 0;
+    uint32_t last = d->clip_bottom - offset > 0 ? d->clip_bottom - offset : 0;
+    if (last < first) last = first;
+
+    char* path = content->images[img];
+    uint32_t path_len = strlen(path);
+    uint32_t scale;
+    memcpy(&scale, &d->scale_factor, sizeof(scale));
+    uint32_t request[3] = {htonl(first), htonl(last), htonl(scale)};
+    uint32_t be_len = htonl(path_len);
+    uint32_t header[6];
+    if (write(w->to, &be_len, sizeof(be_len)) != sizeof(be_len) ||
+            write(w->to, path, path_len) != path_len ||
+            write(w->to, request, sizeof(request)) != sizeof(request) ||
+            !read_all(w->from, header, sizeof(header))) {
+        /* Try again with a fresh worker next time */
+        fprintf(stderr, "%s: decoder worker died\n", name);
+        stop_worker(w);
+        return POOL_UNAVAILABLE;
+    }
+    if (memcmp(POOL_MAGIC, header, 8) != 0) {
+        fprintf(stderr, "%s: bad header magic from worker\n", name);
+        stop_worker(w);
+        return POOL_UNAVAILABLE;
+    }
+
+    uint32_t width = ntohl(header[2]);
+    uint32_t height = ntohl(header[3]);
+    uint32_t out_width = ntohl(header[4]);
+    uint32_t out_rows = ntohl(header[5]);
+    if (width == 0 || height == 0) return POOL_FAILED;
+    content->heights[img] = height;
+    if (content->max_width < width) {
+        content->max_width = width;
+    }
+
+    /* Stream the rows onto the display; they are already scaled */
+    if (out_rows == 0 || out_width == 0) return POOL_OK;
+    mem_subsystem_t previous = memstat_enter(MEM_CACHE);
+    uint8_t *row = malloc((size_t)out_width * 4);
+    memstat_leave(previous);
+    if (row == NULL) {
+        fprintf(stderr, "%s: malloc(): %s\n", name, strerror(errno));
+        stop_worker(w);
+        return POOL_FAILED;
+    }
+    for (uint32_t y = first; y < first + out_rows; y++) {
+        if (!read_all(w->from, row, (size_t)out_width * 4)) {
+            fprintf(stderr, "%s: decoder worker died\n", name);
+            stop_worker(w);
+            break;
+        }
+        plot_row(d, row, out_width, 1, y + offset);
+    }
+    free(row);
+    return w->pid == 0 ? POOL_FAILED : POOL_OK;
+}
 
 bool render_image(char* name, display_t *d, content_t *content,
         int img, int offset) {
@@ -161,19 +660,77 @@ bool render_image(char* name, display_t *d, content_t *content,
      * and loading takes time so we can't preload the images either!
      * Instead, stream the result to the screen as we load the image, using a
      * temporary buffer to avoid calling read() too many times.
+     *
+     * If SHM_HELPER is installed we run that instead, and it writes 8 bit
+     * rows into a shared memory ring buffer passed as SHM_FD (see
+     * render_shm), which saves both the copy through the pipe and converting
+     * from 16 bit channels. Plain TO_FARBFELD doesn't know about the ring, so
+     * we only set it up for SHM_HELPER.
      * 
+     * If the decoder worker pool is available we use that instead, which
+     * avoids starting a new helper for every image (see render_pooled).
+     *
+     * Images which are already farbfeld, such as the ones the scrapers write
+     * with -w, are read straight from the file without any helper at all,
+     * and only the rows which are actually visible are read.
+     *
      * FIXME: Loading the same image many times is quite inefficient!
      */
 
+    int input = open(content->images[img], O_RDONLY | O_CLOEXEC);
+    if (input != -1) {
+        uint32_t header[4];
+        if (read_all(input, header, sizeof(header)) &&
+                memcmp("farbfeld", header, 8) == 0) {
+            uint32_t width = ntohl(header[2]);
+            uint32_t height = ntohl(header[3]);
+            content->heights[img] = height;
+            if (content->max_width < width) {
+                content->max_width = width;
+            }
+            render_farbfeld_file(d, content, input, width, height, offset,
+                    name, img);
+            close(input);
+            return true;
+        }
+        close(input);
+    }
+
+    pool_result_t pooled = render_pooled(name, d, content, img, offset);
+    if (pooled != POOL_UNAVAILABLE) return pooled == POOL_OK;
+
+    /* Set up the shared ring buffer, if the helper can use it */
+    int shm = -1;
+    int acks[2] = {-1, -1};
+    if (content->shm_helper) {
+        shm = memfd_create("comic-viewer", MFD_CLOEXEC);
+    }
+    if (shm != -1 && pipe2(acks, O_CLOEXEC) == -1) {
+        close(shm);
+        shm = -1;
+    }
+
     /* Start the helper process */
     int pipes[2];
     if (pipe(pipes) == -1) {
         fprintf(stderr, "%s: pipe(): %s\n", name, strerror(errno));
+        if (shm != -1) {
+            close(shm);
+            close(acks[0]);
+            close(acks[1]);
+        }
         return false;
     }
     pid_t child = fork();
     if (child == -1) {
         fprintf(stderr, "%s: fork(): %s\n", name, strerror(errno));
+        close(pipes[0]);
+        close(pipes[1]);
+        if (shm != -1) {
+            close(shm);
+            close(acks[0]);
+            close(acks[1]);
+        }
         return false;
     } else if (child == 0) {
         /* Redirect stdout to the pipe */
@@ -184,6 +741,28 @@ bool render_image(char* name, display_t *d, content_t *content,
         close(pipes[0]);
         close(pipes[1]);
 
+        /* Pass the ring buffer and acknowledgement pipe on.
+         *
+         * Either of them could already be sitting on SHM_FD or ACK_FD, so
+         * move them out of the way first. The originals are close-on-exec,
+         * so the helper only gets these copies, and never our end of the
+         * pipe.
+         */
+        if (shm != -1) {
+            int shm_copy = fcntl(shm, F_DUPFD, ACK_FD + 1);
+            int ack_copy = fcntl(acks[0], F_DUPFD, ACK_FD + 1);
+            if (shm_copy == -1 || ack_copy == -1 ||
+                    dup2(shm_copy, SHM_FD) == -1 ||
+                    dup2(ack_copy, ACK_FD) == -1) {
+                fprintf(stderr, "%s: dup2(): %s\n", name, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            close(shm_copy);
+            close(ack_copy);
+            setenv("FARBFELD_SHM_FD", SHM_FD_STRING, 1);
+            setenv("FARBFELD_ACK_FD", ACK_FD_STRING, 1);
+        }
+
         /* Open the file and pass it to the child as stdin */
         int input = open(content->images[img], 0);
         if (input == -1) {
@@ -197,91 +776,50 @@ bool render_image(char* name, display_t *d, content_t *content,
         }
         close(input);
 
-        execl(TO_FARBFELD, TO_FARBFELD, NULL);
-        fprintf(stderr, "%s: execl(%s): %s\n", name, TO_FARBFELD,
+        char* helper = shm != -1 ? SHM_HELPER : TO_FARBFELD;
+        execl(helper, helper, NULL);
+        fprintf(stderr, "%s: execl(%s): %s\n", name, helper,
                 strerror(errno));
         exit(EXIT_FAILURE);
     } else {
         close(pipes[1]);
+        if (shm != -1) close(acks[0]);
     }
 
     /* Load the header */
+    bool ok = true;
     uint32_t header[4];
     // TODO: Retry on transient failure...
-    if (read(pipes[0], header, sizeof(header)) != sizeof(header)) {
+    if (!read_all(pipes[0], header, sizeof(header))) {
         fprintf(stderr, "%s: read(): %s\n", name, strerror(errno));
-        return false;
-    }
-    if (memcmp("farbfeld", header, 8) != 0) {
+        ok = false;
+    } else if (memcmp("farbfeld", header, 8) != 0 &&
+            (shm == -1 || memcmp(SHM_MAGIC, header, 8) != 0)) {
         fprintf(stderr, "%s: bad header magic\n", name);
-        return false;
-    }
-    uint32_t width = ntohl(header[2]);
-    uint32_t height = ntohl(header[3]);
-    /* We need to save the height and width when we find it, so do that here */
-    content->heights[img] = height;
-    if (content->max_width < width) {
-        content->max_width = width;
-    }
-
-    int x = 0; /* Current x position in the image */
-    int y = 0; /* Current y position in the image */
-    ssize_t count = 1; /* Number of bytes read */
-    while (count > 0 || (count == -1 && errno == EINTR)) {
-        count = read(pipes[0], &content->readbuf, sizeof(content->readbuf));
-        for (int i = 0; i < (count / 8); i++) {
-            /* Current x, y positions on the display */
-            int display_y = (y / d->scale_factor) + offset;
-            int display_x = (x / d->scale_factor) - d->offset_x;
-
-            /* Plot the actual point.
-             *
-             * Because libnsfb doesn't provide a "set-pixel" function, we
-             * plot into the buffer directly. For this to work we need the
-             * buffer to be set to NSFB_FMT_RGB888, and we have to be *very*
-             * careful not to draw either outside the screen or outside of the
-             * area declared by our image (eg if we get extra data from the
-             * helper).
-             */
-            if (y < height &&
-                    display_x >= 0 && display_x < d->width &&
-                    display_y >= 0 && display_y < d->height) {
-                unsigned char blue = content->readbuf[8*i + 0];
-                unsigned char green = content->readbuf[8*i + 2];
-                unsigned char red = content->readbuf[8*i + 4];
-
-                if (d->format == NSFB_FMT_RGB888) {
-                    int buf_offset = display_x * 4 + display_y * d->stride;
-                    d->buf[buf_offset + 0] = red;
-                    d->buf[buf_offset + 1] = green;
-                    d->buf[buf_offset + 2] = blue;
-                }
-                if (d->format == NSFB_FMT_ARGB8888 ||
-                    d->format == NSFB_FMT_XRGB8888) {
-                    int buf_offset = display_x * 4 + display_y * d->stride;
-                    d->buf[buf_offset + 0] = red;
-                    d->buf[buf_offset + 1] = green;
-                    d->buf[buf_offset + 2] = blue;
-                }
-                if (d->format == NSFB_FMT_ABGR8888 ||
-                    d->format == NSFB_FMT_XBGR8888) {
-                    int buf_offset = display_x * 4 + display_y * d->stride;
-                    d->buf[buf_offset + 0] = blue;
-                    d->buf[buf_offset + 1] = green;
-                    d->buf[buf_offset + 2] = red;
-                }
-            }
+        ok = false;
+    } else {
+        uint32_t width = ntohl(header[2]);
+        uint32_t height = ntohl(header[3]);
+        /* We need to save the height and width when we find it, so do that
+         * here.
+         */
+        content->heights[img] = height;
+        if (content->max_width < width) {
+            content->max_width = width;
+        }
 
-            x++;
-            if (x >= width) {
-                x = 0;
-                y++;
-            }
+        if (memcmp("farbfeld", header, 8) == 0) {
+            render_farbfeld(d, content, pipes[0], width, height, 0, height,
+                    offset, name, img);
+        } else {
+            render_shm(d, content, pipes[0], shm, acks[1], width, height,
+                    offset, name, img);
         }
     }
-    if (x != 0 && y != height) {
-        fprintf(stderr, "%s: image %s seems corrupted\n", content->images[img],
-                name);
+    close(pipes[0]);
+    if (shm != -1) {
+        close(shm);
+        close(acks[1]);
     }
 
     /* Wait for the child */
@@ -295,29 +833,48 @@ bool render_image(char* name, display_t *d, content_t *content,
         fprintf(stderr, "%s: waitpid(): %s\n", name, strerror(errno));
     }
 
-    return true;
+    return ok;
 }
 
 
-void render(char* name, display_t *d, content_t *c) {
-    /* Render the visible screen content */
-
-    // FIXME: Don't redraw the entire window.
+void fill_rows(display_t *d, int top, int bottom, nsfb_colour_t colour) {
+    /* Fill the given rows of the back buffer, within the clip rows */
+    if (top < d->clip_top) top = d->clip_top;
+    if (bottom > d->clip_bottom) bottom = d->clip_bottom;
+    for (int y = top; y < bottom; y++) {
+        fill_row(d->buf + y * d->stride, d->format, colour, d->width,
+                d->stride);
+    }
+}
 
+void commit(char* name, display_t *d) {
+    /* Copy the back buffer onto the screen, and show it with a single
+     * update.
+     */
     nsfb_bbox_t display_box = {0, 0, d->width, d->height};
     if (nsfb_claim(d->nsfb, &display_box) != 0) {
         fprintf(stderr, "%s: failed to claim window region\n", name);
         return;
     }
+    memcpy(d->screen, d->buf, (size_t)d->height * d->stride);
+    if (nsfb_update(d->nsfb, &display_box) != 0) {
+        fprintf(stderr, "%s: failed to update window\n", name);
+    }
+}
 
-    nsfb_plot_clg(d->nsfb, BACKGROUND_COLOUR);
+int draw(char* name, display_t *d, content_t *c) {
+    /* Draw the images onto the clip rows of the back buffer.
+     *
+     * Return the total (scaled) height of the images.
+     */
+    fill_rows(d, d->clip_top, d->clip_bottom, BACKGROUND_COLOUR);
 
-    /* Display the images */
     int start_height = 0;
     for (int i = 0; i < c->image_count; i++) {
-        if (start_height + (c->heights[i] / d->scale_factor) >= d->offset_y &&
-                start_height - d->height < d->offset_y) {
-            if (!render_image(name, d, c, i, start_height - d->offset_y)) {
+        int top = start_height - d->offset_y;
+        if (top + (c->heights[i] / d->scale_factor) >= d->clip_top &&
+                top < d->clip_bottom) {
+            if (!render_image(name, d, c, i, top)) {
                 /* If we can't render, then fallback and just fill with the
                  * error colour.
                  */
@@ -325,31 +882,57 @@ void render(char* name, display_t *d, content_t *c) {
                     /* Use a placeholder height */
                     c->heights[i] = FALLBACK_HEIGHT;
                 }
-                nsfb_bbox_t rect = {
-                    0, start_height - d->offset_y,
-                    d->width, start_height - d->offset_y + 
-                              (c->heights[i] / d->scale_factor),
-                };
-                if (!nsfb_plot_rectangle_fill(d->nsfb, &rect, ERROR_COLOUR)) {
-                    fprintf(stderr, "%s: fallback plot failed\n", name);
-                }
+                fill_rows(d, top, top + (c->heights[i] / d->scale_factor),
+                        ERROR_COLOUR);
             }
         }
         start_height += c->heights[i] / d->scale_factor;
     }
+    return start_height;
+}
+
+void render(char* name, display_t *d, content_t *c) {
+    /* Render the visible screen content.
+     *
+     * If we have only scrolled up or down since the last render, the rows
+     * which are still visible are moved rather than redrawn, and only the
+     * newly exposed rows are drawn.
+     */
+    d->clip_top = 0;
+    d->clip_bottom = d->height;
+    int dy = d->offset_y - d->drawn_y;
+    if (d->drawn && d->drawn_x == d->offset_x &&
+            d->drawn_scale == d->scale_factor && abs(dy) < d->height) {
+        size_t kept = (size_t)(d->height - abs(dy)) * d->stride;
+        if (dy >= 0) {
+            memmove(d->buf, d->buf + (size_t)dy * d->stride, kept);
+            d->clip_top = d->height - dy;
+        } else {
+            memmove(d->buf + (size_t)-dy * d->stride, d->buf, kept);
+            d->clip_bottom = -dy;
+        }
+    }
+
+    int total_height = draw(name, d, c);
+    d->drawn = true;
+    d->drawn_y = d->offset_y;
+    d->drawn_x = d->offset_x;
+    d->drawn_scale = d->scale_factor;
 
     /* If our offset is too large, clamp it and re-render; we shouldn't
      * allow the user to go beyond the end of the images anyway, and will
      * have tried to render all the images at this point so we know the actual
      * total height.
      *
-     * TODO: What is the effect of this on performance??
+     * Since the back buffer is reused, this only draws the rows that were
+     * past the end.
      */
-    int max_offset_y = start_height - d->height;
+    int max_offset_y = total_height - d->height;
     if (max_offset_y < 0) max_offset_y = 0;
     if (d->offset_y > max_offset_y) {
         d->offset_y = max_offset_y;
         render(name, d, c);
+        return;
     }
     /* We don't know the maximum width, but we do know the maximum width found
      * so far, which includes the current width. We can use this to clamp to
@@ -360,11 +943,75 @@ void render(char* name, display_t *d, content_t *c) {
     if (d->offset_x > max_offset_x) {
         d->offset_x = max_offset_x;
         render(name, d, c);
+        return;
     }
 
-    if (nsfb_update(d->nsfb, &display_box) != 0) {
-        fprintf(stderr, "%s: failed to update window\n", name);
+    commit(name, d);
+}
+
+double now(void) {
+    /* Return the current (monotonic) time in seconds */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int scroll_base(display_t *d) {
+    /* Return the offset further scrolling should be relative to; this is
+     * where the current smooth scroll will end, so that repeated key presses
+     * add up.
+     */
+    return d->scrolling ? d->scroll_to : d->offset_y;
+}
+
+void scroll_to(char* name, display_t *d, content_t *c, int offset_y) {
+    /* Scroll to the given vertical offset.
+     *
+     * In smooth mode this only starts the scroll; scroll_frame draws it.
+     * Without the worker pool we always jump straight there.
+     */
+    if (offset_y < 0) offset_y = 0;
+    if (!d->smooth || c->pool_disabled) {
+        d->offset_y = offset_y;
+        render(name, d, c);
+        return;
     }
+    d->scroll_from = d->offset_y;
+    d->scroll_to = offset_y;
+    d->scroll_start = now();
+    if (!d->scrolling) d->next_frame = d->scroll_start;
+    d->scrolling = true;
+}
+
+int frame_timeout(display_t *d) {
+    /* Return the number of milliseconds until the next smooth scrolling
+     * frame is due, or -1 if we aren't scrolling.
+     */
+    if (!d->scrolling) return -1;
+    double wait = d->next_frame - now();
+    return wait > 0 ? wait * 1000 : 0;
+}
+
+void scroll_frame(char* name, display_t *d, content_t *c) {
+    /* Draw the next frame of a smooth scroll, if it is due.
+     *
+     * The position is worked out from the time, so if drawing falls behind
+     * we skip the frames we are too late for rather than slowing down.
+     */
+    double t = now();
+    if (!d->scrolling || t < d->next_frame) return;
+
+    double progress = (t - d->scroll_start) / SMOOTH_TIME;
+    if (progress > 1) progress = 1;
+    progress = 1 - (1 - progress) * (1 - progress); /* Ease out */
+    int offset_y = d->scroll_from + (d->scroll_to - d->scroll_from) * progress;
+    d->offset_y = offset_y;
+    render(name, d, c);
+
+    /* Stop at the end, or if we have run into the bottom */
+    if (progress >= 1 || d->offset_y != offset_y) d->scrolling = false;
+    d->next_frame += 1.0 / SMOOTH_FPS;
+    if (d->next_frame < now()) d->next_frame = now();
 }
 
 
@@ -382,37 +1029,38 @@ int main(int argc, char** argv) {
     display_t d;
     initialise_display(name, &d);
 
+    /* Helpers may exit before reading all of our acknowledgements */
+    signal(SIGPIPE, SIG_IGN);
+
     render(name, &d, &content);
 
     /* Handle events */
     while (1) {
         nsfb_event_t event;
-        if (nsfb_event(d.nsfb, &event, -1)) {
+        if (nsfb_event(d.nsfb, &event, frame_timeout(&d))) {
 
             if (event.type == NSFB_EVENT_CONTROL) {
-                if (event.value.controlcode == NSFB_CONTROL_QUIT) exit(0);
+                if (event.value.controlcode == NSFB_CONTROL_QUIT) break;
             } else if (event.type == NSFB_EVENT_KEY_DOWN) {
                 enum nsfb_key_code_e code = event.value.keycode;
-                if (code == NSFB_KEY_q) exit(0);
+                if (code == NSFB_KEY_q) break;
 
                 if (code == NSFB_KEY_PAGEDOWN) {
-                    d.offset_y += d.height * PAGE_MULT;
-                    render(name, &d, &content);
+                    scroll_to(name, &d, &content,
+                            scroll_base(&d) + d.height * PAGE_MULT);
                 }
                 if (code == NSFB_KEY_PAGEUP) {
-                    d.offset_y -= d.height * PAGE_MULT;
-                    if (d.offset_y < 0) d.offset_y = 0;
-                    render(name, &d, &content);
+                    scroll_to(name, &d, &content,
+                            scroll_base(&d) - d.height * PAGE_MULT);
                 }
 
                 if (code == NSFB_KEY_DOWN) {
-                    d.offset_y += d.height * ARROW_MULT;
-                    render(name, &d, &content);
+                    scroll_to(name, &d, &content,
+                            scroll_base(&d) + d.height * ARROW_MULT);
                 }
                 if (code == NSFB_KEY_UP) {
-                    d.offset_y -= d.height * ARROW_MULT;
-                    if (d.offset_y < 0) d.offset_y = 0;
-                    render(name, &d, &content);
+                    scroll_to(name, &d, &content,
+                            scroll_base(&d) - d.height * ARROW_MULT);
                 }
 
                 if (code == NSFB_KEY_RIGHT) {
@@ -426,8 +1074,10 @@ int main(int argc, char** argv) {
                 }
 
                 if (code == NSFB_KEY_HOME) {
-                    d.offset_y = 0;
-                    render(name, &d, &content);
+                    scroll_to(name, &d, &content, 0);
+                }
+                if (code == NSFB_KEY_s) {
+                    d.smooth = !d.smooth;
                 }
 
                 if (code == NSFB_KEY_EQUALS || code == NSFB_KEY_KP_PLUS) {
@@ -450,5 +1100,11 @@ int main(int argc, char** argv) {
                 render(name, &d, &content);
             }
         }
+        scroll_frame(name, &d, &content);
+    }
+
+    for (int i = 0; i < POOL_SIZE; i++) {
+        stop_worker(&content.workers[i]);
     }
+    return EXIT_SUCCESS;
 }
@@ -0,0 +1,233 @@
+/* decoder-shm.c
+ *
+ * Reference helper for comic-viewer's shared memory ring (see render_shm in
+ * comic-viewer.c).
+ *
+ * The image is read from stdin and decoded with TO_FARBFELD. If the viewer
+ * passed a ring buffer (FARBFELD_SHM_FD and FARBFELD_ACK_FD), the rows are
+ * converted to 8 bit RGBX and written straight into the ring, so the viewer
+ * neither copies them through a pipe nor converts them itself. Otherwise
+ * this just runs TO_FARBFELD in its place.
+ *
+ * Author:  Alastair Hughes
+ * Contact: hobbitalastair at yandex dot com
+ */
+
+#define _GNU_SOURCE /* For pipe2 */
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define TO_FARBFELD "/usr/bin/2ff" /* Helper program to convert to farbfeld */
+#define SHM_MAGIC "farbshm" /* Header magic for the shared memory protocol */
+#define SHM_MAX_SIZE (4 * 1024 * 1024) /* Largest ring the viewer will map */
+#define RING_ROWS 64 /* Rows to put in the ring, if they fit */
+
+extern char** environ;
+
+char* name = __FILE__;
+
+bool read_all(int fd, void *buf, size_t len) {
+    /* Read exactly len bytes, returning false on failure or early EOF */
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t count = read(fd, p, len);
+        if (count == -1 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        p += count;
+        len -= count;
+    }
+    return true;
+}
+
+bool write_all(int fd, const void *buf, size_t len) {
+    /* Write exactly len bytes, returning false on failure */
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t count = write(fd, p, len);
+        if (count == -1 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        p += count;
+        len -= count;
+    }
+    return true;
+}
+
+int env_fd(char* var) {
+    /* Return the fd named by the given environment variable, or -1 */
+    char* value = getenv(var);
+    if (value == NULL || *value == '\0') return -1;
+    char* end;
+    long fd = strtol(value, &end, 10);
+    if (*end != '\0' || fd < 0 || fcntl(fd, F_GETFD) == -1) return -1;
+    return fd;
+}
+
+pid_t start_decoder(int* out) {
+    /* Start TO_FARBFELD on our stdin, setting "out" to its stdout.
+     *
+     * Return the pid, or -1 on failure.
+     */
+    int pipes[2];
+    if (pipe2(pipes, O_CLOEXEC) == -1) {
+        fprintf(stderr, "%s: pipe(): %s\n", name, strerror(errno));
+        return -1;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipes[1], 1);
+    char* argv[] = {TO_FARBFELD, NULL};
+    pid_t child;
+    int err = posix_spawn(&child, TO_FARBFELD, &actions, NULL, argv,
+            environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipes[1]);
+    if (err != 0) {
+        fprintf(stderr, "%s: posix_spawn(%s): %s\n", name, TO_FARBFELD,
+                strerror(err));
+        close(pipes[0]);
+        return -1;
+    }
+    *out = pipes[0];
+    return child;
+}
+
+bool send_rows(int in, int shm, int ack, uint32_t width, uint32_t height) {
+    /* Copy the farbfeld rows from "in" into the ring, as 8 bit RGBX.
+     *
+     * We tell the viewer how many rows we have written so far every half a
+     * ring, and only wait for its replies (the number of rows it has drawn)
+     * once the ring is full. Every count we send gets a reply, so we read
+     * all of them before returning.
+     *
+     * Return false on failure.
+     */
+    size_t row_size = (size_t)width * 4;
+    uint32_t ring_rows = SHM_MAX_SIZE / row_size;
+    if (ring_rows > RING_ROWS) ring_rows = RING_ROWS;
+    if (ring_rows > height) ring_rows = height;
+    if (ring_rows == 0) ring_rows = 1;
+    size_t ring_size = row_size * ring_rows;
+    if (ftruncate(shm, ring_size) == -1) {
+        fprintf(stderr, "%s: ftruncate(): %s\n", name, strerror(errno));
+        return false;
+    }
+    uint8_t *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, shm, 0);
+    uint8_t *row = malloc((size_t)width * 8);
+    if (ring == MAP_FAILED || row == NULL) {
+        fprintf(stderr, "%s: failed to set up the ring: %s\n", name,
+                strerror(errno));
+        if (ring != MAP_FAILED) munmap(ring, ring_size);
+        free(row);
+        return false;
+    }
+
+    bool ok = true;
+    uint32_t be = htonl(ring_rows);
+    if (!write_all(1, &be, sizeof(be))) ok = false;
+    uint32_t written = 0; /* Rows in the ring so far */
+    uint32_t sent = 0; /* Rows we have told the viewer about */
+    uint32_t consumed = 0; /* Rows the viewer has drawn */
+    int pending = 0; /* Replies still to read */
+    while (ok && written < height) {
+        /* Wait for room in the ring */
+        while (ok && written - consumed >= ring_rows) {
+            if (sent != written) {
+                be = htonl(written);
+                ok = write_all(1, &be, sizeof(be));
+                sent = written;
+                pending++;
+            }
+            if (ok && (ok = read_all(ack, &be, sizeof(be)))) {
+                consumed = ntohl(be);
+                pending--;
+            }
+        }
+        if (!ok || !read_all(in, row, (size_t)width * 8)) {
+            ok = false;
+            break;
+        }
+
+        uint8_t *slot = ring + (written % ring_rows) * row_size;
+        for (uint32_t x = 0; x < width; x++) {
+            slot[4*x + 0] = row[8*x + 0];
+            slot[4*x + 1] = row[8*x + 2];
+            slot[4*x + 2] = row[8*x + 4];
+            slot[4*x + 3] = 0;
+        }
+        written++;
+
+        if (written - sent >= (ring_rows + 1) / 2 || written == height) {
+            be = htonl(written);
+            ok = write_all(1, &be, sizeof(be));
+            sent = written;
+            pending++;
+        }
+    }
+
+    /* The viewer replies to everything, so wait for that before going */
+    while (ok && pending > 0 && read_all(ack, &be, sizeof(be))) pending--;
+    munmap(ring, ring_size);
+    free(row);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 0) name = argv[0];
+    int shm = env_fd("FARBFELD_SHM_FD");
+    int ack = env_fd("FARBFELD_ACK_FD");
+    if (shm == -1 || ack == -1) {
+        /* No ring, so there is nothing for us to do */
+        execl(TO_FARBFELD, TO_FARBFELD, NULL);
+        fprintf(stderr, "%s: execl(%s): %s\n", name, TO_FARBFELD,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+    fcntl(shm, F_SETFD, FD_CLOEXEC);
+    fcntl(ack, F_SETFD, FD_CLOEXEC);
+
+    int in;
+    pid_t child = start_decoder(&in);
+    if (child == -1) return EXIT_FAILURE;
+
+    uint32_t header[4];
+    bool ok = read_all(in, header, sizeof(header)) &&
+        memcmp("farbfeld", header, 8) == 0;
+    if (!ok) {
+        fprintf(stderr, "%s: bad output from %s\n", name, TO_FARBFELD);
+    } else {
+        uint32_t width = ntohl(header[2]);
+        uint32_t height = ntohl(header[3]);
+        if (width == 0 || (size_t)width * 4 > SHM_MAX_SIZE) {
+            /* Too wide for the ring, so pass the farbfeld on as it is */
+            char buf[4096];
+            ssize_t count;
+            ok = write_all(1, header, sizeof(header));
+            while (ok && (count = read(in, buf, sizeof(buf))) > 0) {
+                ok = write_all(1, buf, count);
+            }
+        } else {
+            memcpy(header, SHM_MAGIC, 8);
+            ok = write_all(1, header, sizeof(header)) &&
+                send_rows(in, shm, ack, width, height);
+        }
+    }
+    close(in);
+
+    int status;
+    if (waitpid(child, &status, 0) != child || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != EXIT_SUCCESS) {
+        ok = false;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
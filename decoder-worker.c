@@ -0,0 +1,366 @@
+/* decoder-worker.c
+ *
+ * Long lived decoder for comic-viewer's worker pool (see render_pooled in
+ * comic-viewer.c).
+ *
+ * Requests arrive on stdin, one after another:
+ *
+ *     u32 path length, path, u32 first row, u32 last row, u32 scale
+ *
+ * For each one we decode the image with TO_FARBFELD and reply with the
+ * "farbpool" magic, the unscaled width and height, the scaled width and the
+ * number of rows sent, followed by the requested (half open) range of rows of
+ * the scaled image as 8 bit RGBX. The scale is the bits of the viewer's
+ * (float) scale factor, where values over 1 shrink the image. All numbers
+ * are big endian. An image which can't be decoded gets a width and height
+ * of zero.
+ *
+ * The viewer asks for the same image again every time it scrolls, so we keep
+ * rows of the last image we decoded as 8 bit RGBX in an unlinked temporary
+ * file; it lives in the page cache (or tmpfs) rather than in our memory, and
+ * requests which fall inside those rows only need to read the ones they use.
+ * We keep at most CACHE_MAX bytes of rows, around the ones last asked for,
+ * unless a single request needs more than that; then we keep just those.
+ * Scrolling out of the rows we have decodes the image again.
+ *
+ * Author:  Alastair Hughes
+ * Contact: hobbitalastair at yandex dot com
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TO_FARBFELD "/usr/bin/2ff" /* Helper program to convert to farbfeld */
+#define POOL_MAGIC "farbpool" /* Header magic for our replies */
+#define SCALE_MIN 0.001 /* Smallest scale factor we accept (enlarging) */
+#define SCALE_MAX 1000 /* Largest scale factor we accept (shrinking) */
+#define CACHE_MAX (16 * 1024 * 1024) /* Most bytes of rows we keep */
+
+extern char** environ;
+
+char* name = __FILE__;
+
+typedef struct {
+    /* The last image we decoded */
+    FILE* file; /* Unlinked file holding the rows, as 8 bit RGBX */
+    bool valid; /* Whether the rest of this is filled in */
+    dev_t dev; /* Identity of the source file, to notice changes */
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char path[PATH_MAX];
+    uint32_t width;
+    uint32_t height;
+    uint32_t start; /* Source rows in the file, as a half open range */
+    uint32_t end;
+} cache_t;
+
+bool read_all(int fd, void *buf, size_t len) {
+    /* Read exactly len bytes, returning false on failure or early EOF */
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t count = read(fd, p, len);
+        if (count == -1 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        p += count;
+        len -= count;
+    }
+    return true;
+}
+
+void source_rows(uint32_t height, uint32_t first, uint32_t last,
+        float scale, uint32_t *start, uint32_t *end) {
+    /* Find the (half open) range of source rows send_rows reads for the
+     * given rows of the scaled image.
+     */
+    uint32_t out_height = (uint32_t)((height - 1) / scale) + 1;
+    if (last > out_height) last = out_height;
+    if (first >= last) {
+        *start = *end = 0;
+        return;
+    }
+    uint32_t y = first * scale;
+    if (y >= height) y = height - 1;
+    while (y > 0 && (uint32_t)((y - 1) / scale) >= first) y--;
+    *start = y;
+    while (y < height && (uint32_t)(y / scale) <= last - 1) y++;
+    *end = y > *start ? y : *start + 1;
+}
+
+bool decode(int input, cache_t *cache, uint32_t first, uint32_t last,
+        float scale) {
+    /* Decode the image open on "input" into the cache, keeping the rows
+     * around the given rows of the scaled image.
+     *
+     * Return false on failure.
+     */
+    int pipes[2];
+    if (pipe(pipes) == -1) {
+        fprintf(stderr, "%s: pipe(): %s\n", name, strerror(errno));
+        return false;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, input, 0);
+    posix_spawn_file_actions_adddup2(&actions, pipes[1], 1);
+    posix_spawn_file_actions_addclose(&actions, pipes[0]);
+    char* argv[] = {TO_FARBFELD, NULL};
+    pid_t child;
+    int err = posix_spawn(&child, TO_FARBFELD, &actions, NULL, argv,
+            environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipes[1]);
+    if (err != 0) {
+        fprintf(stderr, "%s: posix_spawn(%s): %s\n", name, TO_FARBFELD,
+                strerror(err));
+        close(pipes[0]);
+        return false;
+    }
+
+    bool ok = false;
+    uint32_t header[4];
+    uint16_t *row = NULL;
+    uint8_t *rgbx = NULL;
+    if (!read_all(pipes[0], header, sizeof(header)) ||
+            memcmp("farbfeld", header, 8) != 0) {
+        fprintf(stderr, "%s: bad output from %s\n", name, TO_FARBFELD);
+        goto done;
+    }
+    cache->width = ntohl(header[2]);
+    cache->height = ntohl(header[3]);
+    cache->start = cache->end = 0;
+    if (cache->width == 0 || cache->height == 0) {
+        ok = true;
+        goto done;
+    }
+    row = malloc((size_t)cache->width * 8);
+    rgbx = malloc((size_t)cache->width * 4);
+    if (row == NULL || rgbx == NULL) {
+        fprintf(stderr, "%s: malloc(): %s\n", name, strerror(errno));
+        goto done;
+    }
+
+    /* Keep as many rows as fit in CACHE_MAX, mostly after the ones we need
+     * since the viewer usually scrolls down.
+     */
+    uint32_t start, end;
+    source_rows(cache->height, first, last, scale, &start, &end);
+    size_t keep = CACHE_MAX / ((size_t)cache->width * 4);
+    if (keep > end - start) {
+        size_t spare = keep - (end - start);
+        start = start > spare / 4 ? start - spare / 4 : 0;
+        end = keep < cache->height - start ? start + keep : cache->height;
+        start = end > keep ? end - keep : 0;
+    }
+
+    if (ftruncate(fileno(cache->file), 0) == -1) {
+        fprintf(stderr, "%s: ftruncate(): %s\n", name, strerror(errno));
+        goto done;
+    }
+    rewind(cache->file);
+    uint32_t y;
+    for (y = 0; y < cache->height; y++) {
+        if (!read_all(pipes[0], row, (size_t)cache->width * 8)) break;
+        if (y < start || y >= end) continue;
+        for (uint32_t x = 0; x < cache->width; x++) {
+            /* Keep the high byte of each (big endian) channel */
+            rgbx[4*x + 0] = ((uint8_t*)row)[8*x + 0];
+            rgbx[4*x + 1] = ((uint8_t*)row)[8*x + 2];
+            rgbx[4*x + 2] = ((uint8_t*)row)[8*x + 4];
+            rgbx[4*x + 3] = 0;
+        }
+        if (fwrite(rgbx, 4, cache->width, cache->file) != cache->width) {
+            fprintf(stderr, "%s: fwrite(): %s\n", name, strerror(errno));
+            break;
+        }
+    }
+    if (y != cache->height) {
+        fprintf(stderr, "%s: image seems corrupted\n", name);
+    } else if (fflush(cache->file) != 0) {
+        fprintf(stderr, "%s: fflush(): %s\n", name, strerror(errno));
+    } else {
+        cache->start = start;
+        cache->end = end;
+        ok = true;
+    }
+
+done:
+    free(row);
+    free(rgbx);
+    close(pipes[0]);
+    int status;
+    if (waitpid(child, &status, 0) != child || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != EXIT_SUCCESS) {
+        ok = false;
+    }
+    return ok;
+}
+
+bool load(char* path, cache_t *cache, uint32_t first, uint32_t last,
+        float scale) {
+    /* Make sure that the rows of the given image which send_rows needs for
+     * the given rows of the scaled image are in the cache.
+     *
+     * Return false if it couldn't be decoded.
+     */
+    int input = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (input == -1 || fstat(input, &st) == -1) {
+        fprintf(stderr, "%s: open(%s): %s\n", name, path, strerror(errno));
+        if (input != -1) close(input);
+        return false;
+    }
+    if (cache->valid && strcmp(cache->path, path) == 0 &&
+            cache->dev == st.st_dev && cache->ino == st.st_ino &&
+            cache->size == st.st_size &&
+            cache->mtime.tv_sec == st.st_mtim.tv_sec &&
+            cache->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        uint32_t start, end;
+        source_rows(cache->height, first, last, scale, &start, &end);
+        if (cache->height == 0 || start == end ||
+                (start >= cache->start && end <= cache->end)) {
+            close(input);
+            return true;
+        }
+    }
+
+    cache->valid = false;
+    bool ok = decode(input, cache, first, last, scale);
+    close(input);
+    if (ok) {
+        strcpy(cache->path, path);
+        cache->dev = st.st_dev;
+        cache->ino = st.st_ino;
+        cache->size = st.st_size;
+        cache->mtime = st.st_mtim;
+        cache->valid = true;
+    }
+    return ok;
+}
+
+bool reply(uint32_t width, uint32_t height, uint32_t out_width,
+        uint32_t out_rows) {
+    /* Write the reply header, returning false on failure */
+    uint32_t header[6] = {
+        0, 0, htonl(width), htonl(height), htonl(out_width), htonl(out_rows),
+    };
+    memcpy(header, POOL_MAGIC, 8);
+    return fwrite(header, sizeof(header), 1, stdout) == 1;
+}
+
+bool send_rows(cache_t *cache, uint32_t first, uint32_t last, float scale) {
+    /* Send the given rows of the scaled image.
+     *
+     * This samples the image the same way comic-viewer does when it scales
+     * rows itself: source column (or row) "x" goes to "x / scale", and the
+     * last one to land on each scaled column wins. When enlarging, columns
+     * nothing lands on repeat the one before.
+     *
+     * Return false on failure.
+     */
+    uint32_t width = cache->width;
+    uint32_t height = cache->height;
+    uint32_t out_width = (uint32_t)((width - 1) / scale) + 1;
+    uint32_t out_height = (uint32_t)((height - 1) / scale) + 1;
+    if (last > out_height) last = out_height;
+    if (first > last) first = last;
+    if (!reply(width, height, out_width, last - first)) return false;
+    if (first == last) return true;
+
+    uint32_t *columns = malloc(out_width * sizeof(uint32_t));
+    uint8_t *row = malloc((size_t)width * 4);
+    uint8_t *out = malloc((size_t)out_width * 4);
+    bool ok = columns != NULL && row != NULL && out != NULL;
+    if (!ok) {
+        fprintf(stderr, "%s: malloc(): %s\n", name, strerror(errno));
+        goto done;
+    }
+    for (uint32_t x = 0; x < out_width; x++) columns[x] = UINT32_MAX;
+    for (uint32_t x = 0; x < width; x++) {
+        uint32_t out_x = x / scale;
+        if (out_x < out_width) columns[out_x] = x;
+    }
+    for (uint32_t x = 0; x < out_width; x++) {
+        if (columns[x] == UINT32_MAX) columns[x] = x > 0 ? columns[x-1] : 0;
+    }
+
+    /* Start from the first source row which could land on "first" */
+    uint32_t y, end;
+    source_rows(height, first, last, scale, &y, &end);
+    uint32_t source = y;
+    for (uint32_t out_y = first; ok && out_y < last; out_y++) {
+        while (y < height && (uint32_t)(y / scale) <= out_y) source = y++;
+        off_t offset = (off_t)(source - cache->start) * width * 4;
+        if (pread(fileno(cache->file), row, (size_t)width * 4, offset) !=
+                (ssize_t)width * 4) {
+            fprintf(stderr, "%s: pread(): %s\n", name, strerror(errno));
+            ok = false;
+            break;
+        }
+        for (uint32_t x = 0; x < out_width; x++) {
+            memcpy(out + 4*x, row + 4*columns[x], 4);
+        }
+        ok = fwrite(out, 4, out_width, stdout) == out_width;
+    }
+
+done:
+    free(columns);
+    free(row);
+    free(out);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 0) name = argv[0];
+
+    cache_t cache;
+    cache.valid = false;
+    cache.file = tmpfile();
+    if (cache.file == NULL) {
+        fprintf(stderr, "%s: tmpfile(): %s\n", name, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    char path[PATH_MAX];
+    uint32_t path_len;
+    while (read_all(0, &path_len, sizeof(path_len))) {
+        path_len = ntohl(path_len);
+        uint32_t request[3];
+        if (path_len >= sizeof(path) || !read_all(0, path, path_len) ||
+                !read_all(0, request, sizeof(request))) {
+            fprintf(stderr, "%s: bad request\n", name);
+            return EXIT_FAILURE;
+        }
+        path[path_len] = '\0';
+        uint32_t first = ntohl(request[0]);
+        uint32_t last = ntohl(request[1]);
+        uint32_t bits = ntohl(request[2]);
+        float scale;
+        memcpy(&scale, &bits, sizeof(scale));
+
+        bool ok;
+        if (!(scale >= SCALE_MIN && scale <= SCALE_MAX) ||
+                !load(path, &cache, first, last, scale) || cache.width == 0 ||
+                cache.height == 0) {
+            ok = reply(0, 0, 0, 0);
+        } else {
+            ok = send_rows(&cache, first, last, scale);
+        }
+        if (!ok || fflush(stdout) != 0) {
+            /* The viewer has gone, or we can't keep our replies in order */
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
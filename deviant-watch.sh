@@ -22,9 +22,18 @@ printf "%s: adding feed for '%s'\n" "$0" "$1"
 
 mkdir "${FEED_DIR}/$1/"
 
+url="https://backend.deviantart.com/rss.xml?q=gallery%3A$1&type=deviation"
+printf '%s\n' "${url}" > "${FEED_DIR}/$1/url"
+
+# Use the copy kept up to date by feed-poll if there is one.
 cat > "${FEED_DIR}/$1/fetch" << EOF
 #!/usr/bin/env sh
-curl -L -o - 'https://backend.deviantart.com/rss.xml?q=gallery%3A$1&type=deviation' | rss2atom
+cd "\$(dirname "\$0")"
+if [ -f feed.xml ]; then
+    rss2atom < feed.xml
+else
+    curl -L -o - '${url}' | rss2atom
+fi
 EOF
 chmod +x "${FEED_DIR}/$1/fetch"
 
@@ -0,0 +1,553 @@
+/* feed-poll.c
+ *
+ * Poll all of the feeds in the feed directory from a single process.
+ *
+ * This reads the layout created by deviant-watch.sh: one directory per feed,
+ * containing a "url" file (or, for older feeds, a "fetch" script with the URL
+ * in single quotes). Every feed is fetched over a shared libcurl connection
+ * pool using conditional requests, and the result is written to "feed.xml"
+ * in the feed directory, but only if the content actually changed.
+ *
+ * Each feed has its own poll interval which backs off while the feed stays
+ * the same and tightens up again when it changes, with some jitter added so
+ * that the feeds don't all end up being polled at once. The interval and
+ * validators are kept in a "poll-state" file so they survive restarts.
+ * The directory of each feed which changed is printed to stdout.
+ *
+ * With -1, every feed is polled once (ignoring the schedule) before exiting.
+ *
+ * Author:  Alastair Hughes
+ * Contact: hobbitalastair at yandex dot com
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+
+#include "memstat.h"
+
+#define MAX_ACTIVE 8 /* Maximum concurrent transfers */
+#define MIN_INTERVAL (15 * 60) /* Shortest poll interval (seconds) */
+#define MAX_INTERVAL (24 * 60 * 60) /* Longest poll interval (seconds) */
+#define DEFAULT_INTERVAL (60 * 60) /* Poll interval for new feeds */
+#define BACKOFF 1.5 /* Interval multiplier while a feed is unchanged */
+#define JITTER 0.1 /* Maximum fraction of the interval to randomly add/remove */
+#define RESCAN_INTERVAL (5 * 60) /* How often to look for new feeds */
+#define VALIDATOR_SIZE 256 /* Maximum stored ETag/Last-Modified length */
+
+char* name = __FILE__;
+
+typedef struct {
+    char* dir; /* Feed directory */
+    char* url; /* Feed URL */
+
+    /* Persistent state */
+    char etag[VALIDATOR_SIZE];
+    char last_modified[VALIDATOR_SIZE];
+    uint64_t hash; /* Hash of the last content written */
+    long interval; /* Current poll interval */
+    time_t next; /* Time of the next poll */
+
+    /* Transfer state */
+    bool active;
+    FILE* tmp; /* Temporary output file */
+    uint64_t tmp_hash; /* Hash of the content so far */
+    char new_etag[VALIDATOR_SIZE];
+    char new_last_modified[VALIDATOR_SIZE];
+    struct curl_slist* headers;
+} feed_t;
+
+typedef struct {
+    char* feed_dir;
+    feed_t** feeds; /* Allocated separately, since transfers point at them */
+    size_t count;
+    size_t size;
+} feeds_t;
+
+
+char* join_path(char* dir, char* file) {
+    /* Return a newly allocated "dir/file" path, or NULL on failure */
+    size_t len = strlen(dir) + strlen(file) + 2;
+    char* path = malloc(len);
+    if (path == NULL) {
+        fprintf(stderr, "%s: malloc(): %s\n", name, strerror(errno));
+        return NULL;
+    }
+    snprintf(path, len, "%s/%s", dir, file);
+    return path;
+}
+
+uint64_t hash_bytes(uint64_t hash, const char* data, size_t len) {
+    /* Update the given FNV-1a hash with some more data.
+     *
+     * This is only used to spot changes, so it doesn't need to be strong.
+     */
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+char* read_url(char* dir) {
+    /* Find the URL for the given feed directory.
+     *
+     * Return a newly allocated string, or NULL if no URL could be found.
+     */
+    char* line = NULL;
+    size_t line_size = 0;
+    char* url = NULL;
+
+    char* path = join_path(dir, "url");
+    if (path == NULL) return NULL;
+    FILE* file = fopen(path, "r");
+    free(path);
+    if (file != NULL) {
+        if (getline(&line, &line_size, file) > 0) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] != '\0') url = strdup(line);
+        }
+        fclose(file);
+        free(line);
+        return url;
+    }
+
+    /* Fall back to the first single quoted URL in the fetch script */
+    path = join_path(dir, "fetch");
+    if (path == NULL) return NULL;
+    file = fopen(path, "r");
+    free(path);
+    if (file == NULL) return NULL;
+    while (url == NULL && getline(&line, &line_size, file) != -1) {
+        char* start = strstr(line, "'http");
+        if (start == NULL) continue;
+        start++;
+        char* end = strchr(start, '\'');
+        if (end == NULL) continue;
+        *end = '\0';
+        url = strdup(start);
+    }
+    fclose(file);
+    free(line);
+    return url;
+}
+
+void load_state(feed_t* f) {
+    /* Load the saved state for the given feed, if there is any */
+    f->etag[0] = '\0';
+    f->last_modified[0] = '\0';
+    f->hash = 0;
+    f->interval = DEFAULT_INTERVAL;
+    f->next = 0;
+
+    char* path = join_path(f->dir, "poll-state");
+    if (path == NULL) return;
+    FILE* file = fopen(path, "r");
+    free(path);
+    if (file == NULL) return;
+
+    char* line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, file) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        char* value = strchr(line, ' ');
+        if (value == NULL) continue;
+        *value++ = '\0';
+        if (strcmp(line, "etag") == 0) {
+            snprintf(f->etag, sizeof(f->etag), "%s", value);
+        } else if (strcmp(line, "last-modified") == 0) {
+            snprintf(f->last_modified, sizeof(f->last_modified), "%s", value);
+        } else if (strcmp(line, "hash") == 0) {
+            f->hash = strtoull(value, NULL, 16);
+        } else if (strcmp(line, "interval") == 0) {
+            f->interval = strtol(value, NULL, 10);
+        } else if (strcmp(line, "next") == 0) {
+            f->next = strtoll(value, NULL, 10);
+        }
+    }
+    free(line);
+    fclose(file);
+
+    if (f->interval < MIN_INTERVAL) f->interval = MIN_INTERVAL;
+    if (f->interval > MAX_INTERVAL) f->interval = MAX_INTERVAL;
+}
+
+void save_state(feed_t* f) {
+    /* Atomically save the state for the given feed */
+    char* path = join_path(f->dir, "poll-state");
+    char* tmp = join_path(f->dir, "poll-state.tmp");
+    if (path == NULL || tmp == NULL) {
+        free(path);
+        free(tmp);
+        return;
+    }
+
+    FILE* file = fopen(tmp, "w");
+    if (file == NULL) {
+        fprintf(stderr, "%s: fopen(%s): %s\n", name, tmp, strerror(errno));
+    } else {
+        if (f->etag[0] != '\0') fprintf(file, "etag %s\n", f->etag);
+        if (f->last_modified[0] != '\0') {
+            fprintf(file, "last-modified %s\n", f->last_modified);
+        }
+        fprintf(file, "hash %016llx\n", (unsigned long long)f->hash);
+        fprintf(file, "interval %ld\n", f->interval);
+        fprintf(file, "next %lld\n", (long long)f->next);
+        if (ferror(file) | (fclose(file) != 0) || rename(tmp, path) != 0) {
+            fprintf(stderr, "%s: failed to save %s\n", name, path);
+            remove(tmp);
+        }
+    }
+    free(path);
+    free(tmp);
+}
+
+void scan_feeds(feeds_t* feeds) {
+    /* Add any feeds in the feed directory that we don't know about yet */
+    DIR* dir = opendir(feeds->feed_dir);
+    if (dir == NULL) {
+        fprintf(stderr, "%s: opendir(%s): %s\n", name, feeds->feed_dir,
+                strerror(errno));
+        return;
+    }
+
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.') continue;
+        char* path = join_path(feeds->feed_dir, ent->d_name);
+        if (path == NULL) break;
+
+        bool known = false;
+        for (size_t i = 0; i < feeds->count; i++) {
+            if (strcmp(feeds->feeds[i]->dir, path) == 0) known = true;
+        }
+        char* url = known ? NULL : read_url(path);
+        if (url == NULL) {
+            free(path);
+            continue;
+        }
+
+        if (feeds->count == feeds->size) {
+            size_t size = feeds->size == 0 ? 64 : feeds->size * 2;
+            feed_t** new = realloc(feeds->feeds, size * sizeof(feed_t*));
+            if (new == NULL) {
+                fprintf(stderr, "%s: realloc(): %s\n", name, strerror(errno));
+                free(path);
+                free(url);
+                break;
+            }
+            feeds->feeds = new;
+            feeds->size = size;
+        }
+        feed_t* f = calloc(1, sizeof(feed_t));
+        if (f == NULL) {
+            fprintf(stderr, "%s: calloc(): %s\n", name, strerror(errno));
+            free(path);
+            free(url);
+            break;
+        }
+        feeds->feeds[feeds->count++] = f;
+        f->dir = path;
+        f->url = url;
+        load_state(f);
+    }
+    closedir(dir);
+}
+
+long jitter(long interval) {
+    /* Return the interval with some random jitter applied */
+    double offset = ((double)rand() / RAND_MAX * 2 - 1) * JITTER;
+    return interval + interval * offset;
+}
+
+size_t write_body(char* ptr, size_t size, size_t nmemb, void* data) {
+    /* Write the body into the temporary file, hashing it as we go */
+    feed_t* f = (feed_t*)data;
+    f->tmp_hash = hash_bytes(f->tmp_hash, ptr, size * nmemb);
+    return fwrite(ptr, size, nmemb, f->tmp) * size;
+}
+
+void copy_header_value(char* dest, char* header, size_t len) {
+    /* Copy a header value without the surrounding whitespace */
+    while (len > 0 && isspace((unsigned char)*header)) {
+        header++;
+        len--;
+    }
+    while (len > 0 && isspace((unsigned char)header[len - 1])) len--;
+    if (len >= VALIDATOR_SIZE) len = 0; /* Too long to be useful */
+    memcpy(dest, header, len);
+    dest[len] = '\0';
+}
+
+size_t write_header(char* ptr, size_t size, size_t nmemb, void* data) {
+    /* Pick out the validators from the response headers */
+    feed_t* f = (feed_t*)data;
+    size_t len = size * nmemb;
+
+    if (len > 5 && strncmp(ptr, "HTTP/", 5) == 0) {
+        /* A new response (after a redirect); forget the old headers */
+        f->new_etag[0] = '\0';
+        f->new_last_modified[0] = '\0';
+    } else if (len > 5 && strncasecmp(ptr, "etag:", 5) == 0) {
+        copy_header_value(f->new_etag, ptr + 5, len - 5);
+    } else if (len > 14 && strncasecmp(ptr, "last-modified:", 14) == 0) {
+        copy_header_value(f->new_last_modified, ptr + 14, len - 14);
+    }
+    return len;
+}
+
+bool start_transfer(CURLM* multi, CURLSH* share, feed_t* f) {
+    /* Start polling the given feed.
+     *
+     * Return false on failure, true on success.
+     */
+    char* tmp = join_path(f->dir, "feed.xml.tmp");
+    if (tmp == NULL) return false;
+    f->tmp = fopen(tmp, "w");
+    if (f->tmp == NULL) {
+        fprintf(stderr, "%s: fopen(%s): %s\n", name, tmp, strerror(errno));
+        free(tmp);
+        return false;
+    }
+    free(tmp);
+    f->tmp_hash = HASH_INIT;
+    f->new_etag[0] = '\0';
+    f->new_last_modified[0] = '\0';
+
+    /* Ask the server to only send the feed if it has changed */
+    char header[VALIDATOR_SIZE + 32];
+    mem_subsystem_t previous = memstat_enter(MEM_CURL);
+    f->headers = NULL;
+    if (f->etag[0] != '\0') {
+        snprintf(header, sizeof(header), "If-None-Match: %s", f->etag);
+        f->headers = curl_slist_append(f->headers, header);
+    }
+    if (f->last_modified[0] != '\0') {
+        snprintf(header, sizeof(header), "If-Modified-Since: %s",
+                f->last_modified);
+        f->headers = curl_slist_append(f->headers, header);
+    }
+
+    CURL* curl = curl_easy_init();
+    if (curl == NULL) {
+        fclose(f->tmp);
+        curl_slist_free_all(f->headers);
+        memstat_leave(previous);
+        return false;
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, f->url);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, f->headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_body);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, f);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, write_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, f);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, f);
+    curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    if (curl_multi_add_handle(multi, curl) != CURLM_OK) {
+        curl_easy_cleanup(curl);
+        fclose(f->tmp);
+        curl_slist_free_all(f->headers);
+        memstat_leave(previous);
+        return false;
+    }
+    memstat_leave(previous);
+    f->active = true;
+    return true;
+}
+
+void finish_transfer(CURLM* multi, CURL* curl, CURLcode result) {
+    /* Handle a completed transfer, and schedule the next poll */
+    feed_t* f;
+    long code = 0;
+    curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**)&f);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    curl_multi_remove_handle(multi, curl);
+    curl_easy_cleanup(curl);
+    curl_slist_free_all(f->headers);
+    f->active = false;
+
+    char* tmp = join_path(f->dir, "feed.xml.tmp");
+    char* path = join_path(f->dir, "feed.xml");
+    bool write_ok = fclose(f->tmp) == 0;
+
+    if (result != CURLE_OK || !write_ok || code < 200 ||
+            (code >= 300 && code != 304)) {
+        /* Back off quickly from broken feeds */
+        if (result != CURLE_OK) {
+            fprintf(stderr, "%s: failed to retrieve %s: %s\n", name, f->url,
+                    curl_easy_strerror(result));
+        } else {
+            fprintf(stderr, "%s: failed to retrieve %s: HTTP %ld\n", name,
+                    f->url, code);
+        }
+        f->interval *= 2;
+    } else if (code == 304 || f->tmp_hash == f->hash) {
+        f->interval *= BACKOFF;
+    } else {
+        if (tmp != NULL && path != NULL && rename(tmp, path) == 0) {
+            printf("%s\n", f->dir);
+            fflush(stdout);
+            f->hash = f->tmp_hash;
+            f->interval /= 2;
+        } else {
+            fprintf(stderr, "%s: failed to update %s: %s\n", name, f->dir,
+                    strerror(errno));
+        }
+    }
+    if (code >= 200 && code < 300 && result == CURLE_OK) {
+        /* The validators belong to whatever content the server sent */
+        strcpy(f->etag, f->new_etag);
+        strcpy(f->last_modified, f->new_last_modified);
+    }
+    if (tmp != NULL) remove(tmp);
+    free(tmp);
+    free(path);
+
+    if (f->interval < MIN_INTERVAL) f->interval = MIN_INTERVAL;
+    if (f->interval > MAX_INTERVAL) f->interval = MAX_INTERVAL;
+    f->next = time(NULL) + jitter(f->interval);
+    save_state(f);
+}
+
+void usage(void) {
+    fprintf(stderr, "usage: %s [-1] [<feed dir>]\n", name);
+}
+
+int main(int argc, char** argv) {
+    if (argc > 0) name = argv[0];
+
+    bool once = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "1")) != -1) {
+        if (opt == '1') {
+            once = true;
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind > 1) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    /* Use the same default feed directory as deviant-watch.sh */
+    feeds_t feeds = {NULL, NULL, 0, 0};
+    char default_dir[PATH_MAX];
+    if (optind < argc) {
+        feeds.feed_dir = argv[optind];
+    } else if (getenv("FEED_DIR") != NULL) {
+        feeds.feed_dir = getenv("FEED_DIR");
+    } else if (getenv("XDG_CONFIG_DIR") != NULL) {
+        snprintf(default_dir, sizeof(default_dir), "%s/feeds",
+                getenv("XDG_CONFIG_DIR"));
+        feeds.feed_dir = default_dir;
+    } else {
+        snprintf(default_dir, sizeof(default_dir), "%s/.config/feeds",
+                getenv("HOME") == NULL ? "" : getenv("HOME"));
+        feeds.feed_dir = default_dir;
+    }
+
+    srand(time(NULL) ^ getpid());
+    mem_subsystem_t previous = memstat_enter(MEM_CURL);
+    if (curl_global_init(CURL_GLOBAL_ALL) != 0) {
+        fprintf(stderr, "%s: failed to initialise libcurl\n", name);
+        memstat_leave(previous);
+        return EXIT_FAILURE;
+    }
+
+    /* All of the transfers go through the one multi handle, so they share
+     * its connection pool; the share handle also lets them reuse DNS
+     * results and TLS sessions.
+     */
+    CURLM* multi = curl_multi_init();
+    CURLSH* share = curl_share_init();
+    if (multi == NULL || share == NULL) {
+        fprintf(stderr, "%s: failed to initialise libcurl\n", name);
+        memstat_leave(previous);
+        return EXIT_FAILURE;
+    }
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)MAX_ACTIVE);
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    memstat_leave(previous);
+
+    scan_feeds(&feeds);
+    time_t last_scan = time(NULL);
+    size_t started = 0; /* Feeds started this round, for -1 */
+    while (1) {
+        time_t now = time(NULL);
+        if (!once && now - last_scan >= RESCAN_INTERVAL) {
+            scan_feeds(&feeds);
+            last_scan = now;
+        }
+
+        /* Start any feeds which are due, and work out how long we can sleep
+         * until the next one is.
+         */
+        int active = 0;
+        time_t next = now + RESCAN_INTERVAL;
+        for (size_t i = 0; i < feeds.count; i++) {
+            if (feeds.feeds[i]->active) active++;
+        }
+        for (size_t i = 0; i < feeds.count; i++) {
+            feed_t* f = feeds.feeds[i];
+            if (f->active || (once && i < started)) continue;
+            if ((once || f->next <= now) && active < MAX_ACTIVE) {
+                if (start_transfer(multi, share, f)) {
+                    active++;
+                } else {
+                    f->next = now + jitter(f->interval);
+                }
+                if (once) started = i + 1;
+            } else if (!once && f->next < next) {
+                next = f->next;
+            }
+        }
+        if (once && active == 0 && started >= feeds.count) break;
+
+        int running;
+        previous = memstat_enter(MEM_CURL);
+        curl_multi_perform(multi, &running);
+        memstat_leave(previous);
+        CURLMsg* msg;
+        int queued;
+        while ((msg = curl_multi_info_read(multi, &queued)) != NULL) {
+            if (msg->msg == CURLMSG_DONE) {
+                finish_transfer(multi, msg->easy_handle, msg->data.result);
+            }
+        }
+
+        /* Sleep until there is network activity or the next feed is due */
+        long timeout = running > 0 ? 1000 : (next - time(NULL)) * 1000;
+        if (timeout < 0) timeout = 0;
+        if (once && running == 0) timeout = 0;
+        previous = memstat_enter(MEM_CURL);
+        curl_multi_poll(multi, NULL, 0, timeout, NULL);
+        memstat_leave(previous);
+    }
+
+    previous = memstat_enter(MEM_CURL);
+    curl_multi_cleanup(multi);
+    curl_share_cleanup(share);
+    curl_global_cleanup();
+    memstat_leave(previous);
+    return EXIT_SUCCESS;
+}
@@ -2,25 +2,84 @@
  *
  * List all of the links in the HTML file fed into stdin.
  *
+ * With -n <count>, stop after the first <count> links; we then stop reading
+ * stdin as well, so whatever is feeding us the page gets SIGPIPE instead of
+ * sending the rest of the document.
+ *
+ * With -s <seen-file>, only print links which weren't printed by an earlier
+ * run using the same file. The file is a table of link hashes which is mapped
+ * rather than read in, and only rewritten (atomically) if we found new links.
+ *
+ * With --serve [<socket>], run as a resident server instead (see serve.h).
+ * The parser for each job is then made while waiting for it.
+ *
  * Author:  Alastair Hughes
  * Contact: hobbitalastair at yandex dot com
  */
 
+#define _GNU_SOURCE
 #include <ctype.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <hubbub/hubbub.h>
 #include <hubbub/parser.h>
 
+#include "memstat.h"
+#include "serve.h"
+
 #define BUF_SIZE 4096
+#define SEEN_MAGIC "htmlseen" /* Seen-file header magic (8 bytes) */
+#define SEEN_MIN_SLOTS 1024 /* Initial seen table size, a power of two */
 
 char* name = __FILE__;
 
+/* Parser for the next job, made while the server is waiting for it.
+ *
+ * hubbub parsers can't be reset, so each one only parses a single page.
+ */
+hubbub_parser* spare_parser = NULL;
+
+/* Header at the start of a seen-file; the slots follow straight after.
+ *
+ * The slots hold 64 bit FNV-1a hashes of the links, in an open-addressing
+ * table with linear probing. Empty slots are 0.
+ */
+typedef struct {
+    char magic[8];
+    uint64_t slots; /* Number of slots, a power of two */
+    uint64_t count; /* Number of slots in use */
+} seen_header_t;
+
+/* An open seen-file.
+ *
+ * The table is mapped privately, so nothing is written back until
+ * seen_commit, and then only if we added something.
+ */
+typedef struct {
+    char* path;
+    seen_header_t* table; /* Mapped table */
+    size_t size; /* Size of the mapping */
+    bool changed; /* Whether anything was added */
+} seen_t;
+
+/* Parsing state shared with the token handler */
+typedef struct {
+    unsigned long count; /* Links printed so far */
+    unsigned long limit; /* Maximum links to print, or 0 for no limit */
+    bool done; /* Set once we have seen everything we want */
+    seen_t* seen; /* Links seen on earlier runs, or NULL */
+} extract_t;
+
 bool string_equal(hubbub_string h, char* s) {
     /* Return true if the given two strings are equal */
     return (strlen(s) == h.len) && strncmp((char*)h.ptr, s, h.len) == 0;
@@ -37,56 +96,321 @@ void print_link(hubbub_string h) {
     putchar('\n');
 }
 
+uint64_t link_hash(hubbub_string h) {
+    /* Return the FNV-1a hash of the link, ignoring whitespace as print_link
+     * does. The result is never 0, which marks an empty slot.
+     */
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < h.len; i++) {
+        char c = *(h.ptr + i);
+        if (isspace(c)) continue;
+        hash ^= (unsigned char)c;
+        hash *= 0x100000001b3;
+    }
+    return hash == 0 ? 1 : hash;
+}
+
+uint64_t* seen_slots(seen_header_t* table) {
+    return (uint64_t*)(table + 1);
+}
+
+seen_header_t* seen_map_new(uint64_t slots, size_t *size) {
+    /* Return a new empty table with the given number of slots, or NULL */
+    *size = sizeof(seen_header_t) + slots * sizeof(uint64_t);
+    seen_header_t* table = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) return NULL;
+    memcpy(table->magic, SEEN_MAGIC, sizeof(table->magic));
+    table->slots = slots;
+    table->count = 0;
+    return table;
+}
+
+bool seen_open(seen_t* seen, char* path) {
+    /* Map the given seen-file, or start a new table if it doesn't exist */
+    struct stat st;
+
+    seen->path = path;
+    seen->changed = false;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 && errno == ENOENT) {
+        seen->table = seen_map_new(SEEN_MIN_SLOTS, &seen->size);
+        if (seen->table == NULL) {
+            fprintf(stderr, "%s: mmap(): %s\n", name, strerror(errno));
+            return false;
+        }
+        return true;
+    } else if (fd == -1) {
+        fprintf(stderr, "%s: open(%s): %s\n", name, path, strerror(errno));
+        return false;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        fprintf(stderr, "%s: fstat(%s): %s\n", name, path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    seen->size = st.st_size;
+    if (seen->size < sizeof(seen_header_t)) {
+        fprintf(stderr, "%s: %s is not a seen-file\n", name, path);
+        close(fd);
+        return false;
+    }
+    seen->table = mmap(NULL, seen->size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+            fd, 0);
+    close(fd);
+    if (seen->table == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap(%s): %s\n", name, path, strerror(errno));
+        return false;
+    }
+
+    uint64_t slots = seen->table->slots;
+    if (memcmp(seen->table->magic, SEEN_MAGIC, sizeof(seen->table->magic))
+            != 0 || slots == 0 || (slots & (slots - 1)) != 0 ||
+            seen->size != sizeof(seen_header_t) + slots * sizeof(uint64_t)) {
+        fprintf(stderr, "%s: %s is not a seen-file\n", name, path);
+        munmap(seen->table, seen->size);
+        return false;
+    }
+    return true;
+}
+
+bool seen_probe(seen_header_t* table, uint64_t hash) {
+    /* Add the hash to the table, returning true if it wasn't already there.
+     *
+     * There must be a free slot.
+     */
+    uint64_t* slots = seen_slots(table);
+    uint64_t mask = table->slots - 1;
+    for (uint64_t i = hash & mask; ; i = (i + 1) & mask) {
+        if (slots[i] == hash) return false;
+        if (slots[i] == 0) {
+            slots[i] = hash;
+            table->count++;
+            return true;
+        }
+    }
+}
+
+bool seen_grow(seen_t* seen) {
+    /* Double the size of the table */
+    size_t size;
+    seen_header_t* table = seen_map_new(seen->table->slots * 2, &size);
+    if (table == NULL) {
+        fprintf(stderr, "%s: mmap(): %s\n", name, strerror(errno));
+        return false;
+    }
+    uint64_t* slots = seen_slots(seen->table);
+    for (uint64_t i = 0; i < seen->table->slots; i++) {
+        if (slots[i] != 0) seen_probe(table, slots[i]);
+    }
+    munmap(seen->table, seen->size);
+    seen->table = table;
+    seen->size = size;
+    return true;
+}
+
+bool seen_insert(seen_t* seen, uint64_t hash) {
+    /* Add the hash to the seen set, returning true if it is new.
+     *
+     * If the table can't grow we carry on with a full(er) table, rather
+     * than lose links.
+     */
+    if ((seen->table->count + 1) * 2 > seen->table->slots) {
+        if (!seen_grow(seen) && seen->table->count + 1 >= seen->table->slots) {
+            return true;
+        }
+    }
+    if (!seen_probe(seen->table, hash)) return false;
+    seen->changed = true;
+    return true;
+}
+
+void seen_close(seen_t* seen) {
+    /* Unmap the table, throwing away any changes */
+    munmap(seen->table, seen->size);
+}
+
+bool seen_commit(seen_t* seen) {
+    /* Write the table back if we added anything, and unmap it.
+     *
+     * The new table is written next to the old one and renamed over it, so
+     * a failed or concurrent run never leaves a partial file.
+     */
+    bool ok = true;
+    if (seen->changed) {
+        char tmp[PATH_MAX];
+        snprintf(tmp, sizeof(tmp), "%s.XXXXXX", seen->path);
+        int fd = mkstemp(tmp);
+        if (fd == -1) {
+            fprintf(stderr, "%s: mkstemp(%s): %s\n", name, tmp,
+                    strerror(errno));
+            ok = false;
+        } else {
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(fd, 0666 & ~mask);
+            char* p = (char*)seen->table;
+            size_t done = 0;
+            while (done < seen->size) {
+                ssize_t count = write(fd, p + done, seen->size - done);
+                if (count <= 0) break;
+                done += count;
+            }
+            if (done != seen->size || fsync(fd) == -1 || close(fd) == -1 ||
+                    rename(tmp, seen->path) == -1) {
+                fprintf(stderr, "%s: failed to write %s: %s\n", name,
+                        seen->path, strerror(errno));
+                unlink(tmp);
+                ok = false;
+            }
+        }
+    }
+    seen_close(seen);
+    return ok;
+}
+
 hubbub_error process_token(const hubbub_token *token, void *data) {
     /* Process a single HTML token */
+    extract_t *e = (extract_t*)data;
+
+    /* The rest of the current chunk still gets tokenized after we hit the
+     * limit, so ignore anything that turns up after that.
+     */
+    if (e->done) return HUBBUB_OK;
+
     if (token->type == HUBBUB_TOKEN_START_TAG) {
         hubbub_tag tag = token->data.tag;
         for (size_t i = 0; i < tag.n_attributes; i++) {
             if (string_equal(tag.attributes[i].name, "href")) {
+                if (e->seen != NULL && !seen_insert(e->seen,
+                            link_hash(tag.attributes[i].value))) {
+                    continue;
+                }
                 print_link(tag.attributes[i].value);
+                e->count++;
+                if (e->limit != 0 && e->count >= e->limit) {
+                    e->done = true;
+                    return HUBBUB_OK;
+                }
             }
         }
     }
     return HUBBUB_OK;
 }
 
-int main(int argc, char** argv) {
+void make_spare_parser(void) {
+    /* Create the parser for the next job, if we don't have one already */
+    if (spare_parser != NULL) return;
+    mem_subsystem_t previous = memstat_enter(MEM_PARSER);
+    if (hubbub_parser_create("UTF-8", false, &spare_parser) != HUBBUB_OK) {
+        spare_parser = NULL; /* The job will try again, and report it */
+    }
+    memstat_leave(previous);
+}
+
+void usage(void) {
+    printf("usage: %s [-n <count>] [-s <seen-file>]\n", name);
+}
+
+int run(int argc, char** argv) {
     if (argc > 0) name = argv[0];
-    if (argc != 1) {
-        printf("usage: %s\n", name);
+
+    extract_t extract = {0, 0, false, NULL};
+    char* seen_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        if (opt == 'n') {
+            char* end;
+            extract.limit = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || extract.limit == 0) {
+                fprintf(stderr, "%s: invalid count '%s'\n", name, optarg);
+                return EXIT_FAILURE;
+            }
+        } else if (opt == 's') {
+            seen_path = optarg;
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc) {
+        usage();
         return EXIT_FAILURE;
     }
 
-    hubbub_parser *parser;
-    if (hubbub_parser_create("UTF-8", false, &parser) != HUBBUB_OK) {
+    /* Use the parser made while we were waiting for this job, if any */
+    hubbub_parser *parser = spare_parser;
+    spare_parser = NULL;
+    mem_subsystem_t previous = memstat_enter(MEM_PARSER);
+    if (parser == NULL &&
+            hubbub_parser_create("UTF-8", false, &parser) != HUBBUB_OK) {
         fprintf(stderr, "%s: failed to create parser\n", name);
+        memstat_leave(previous);
         return EXIT_FAILURE;
     }
+    memstat_leave(previous);
+
+    int status = EXIT_FAILURE;
+    seen_t seen;
     hubbub_parser_optparams params;
     params.token_handler.handler = process_token;
+    params.token_handler.pw = &extract;
     if (hubbub_parser_setopt(parser, HUBBUB_PARSER_TOKEN_HANDLER, &params)
             != HUBBUB_OK) {
         fprintf(stderr, "%s: failed to set token handler\n", name);
-        return EXIT_FAILURE;
+        goto done;
+    }
+    if (seen_path != NULL) {
+        if (!seen_open(&seen, seen_path)) goto done;
+        extract.seen = &seen;
     }
 
     unsigned char buf[BUF_SIZE];
-    size_t count = read(0, &buf, BUF_SIZE);
+    ssize_t count = read(0, &buf, BUF_SIZE);
     while (count > 0) {
-        if (hubbub_parser_parse_chunk(parser, buf, count) != HUBBUB_OK) {
+        previous = memstat_enter(MEM_PARSER);
+        hubbub_error res = hubbub_parser_parse_chunk(parser, buf, count);
+        memstat_leave(previous);
+        if (res != HUBBUB_OK) {
             fprintf(stderr, "%s: failed to parse chunk\n", name);
-            hubbub_parser_destroy(parser);
-            return EXIT_FAILURE;
+            goto done;
         }
+        if (extract.done) break;
 
         count = read(0, &buf, BUF_SIZE);
     }
     if (count < 0) {
         fprintf(stderr, "%s: read(): %s\n", name, strerror(errno));
-        hubbub_parser_destroy(parser);
-        return EXIT_FAILURE;
+        goto done;
+    }
+
+    if (extract.seen != NULL) {
+        /* Only remember the links once they have actually gone out */
+        if (fflush(stdout) != 0) {
+            fprintf(stderr, "%s: failed to write links\n", name);
+            goto done;
+        }
+        bool committed = seen_commit(&seen);
+        extract.seen = NULL; /* seen_commit closes it either way */
+        if (!committed) goto done;
     }
+    status = EXIT_SUCCESS;
 
+done:
+    if (extract.seen != NULL) seen_close(&seen);
+    previous = memstat_enter(MEM_PARSER);
     hubbub_parser_destroy(parser);
+    memstat_leave(previous);
+    return status;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0 && argc <= 3) {
+        name = argv[0];
+        serve_idle = make_spare_parser;
+        return serve(name, argv[2], run);
+    }
+    return run(argc, argv);
 }
 
@@ -0,0 +1,460 @@
+/* links2atom.c
+ *
+ * Create an atom feed from a list of links.
+ *
+ * The links are read from stdin, one per line, optionally followed by a
+ * space and a title.
+ *
+ * If a feed file is given, the new links are merged into it instead: entries
+ * which are already in the feed keep their original order and <updated>
+ * time, while new entries are added to the top with the current time. The
+ * file is only rewritten if something actually changed, so it stays
+ * byte-for-byte identical between runs with no new links.
+ *
+ * Entries which are no longer in the input are kept as history, but only the
+ * newest HISTORY_SIZE of them, so the feed doesn't grow without limit.
+ *
+ * Author:  Alastair Hughes
+ * Contact: hobbitalastair at yandex dot com
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "memstat.h"
+
+#define DATE_SIZE 32 /* Buffer size for formatted dates */
+#define HISTORY_SIZE 100 /* Entries to keep once they leave the input */
+
+char* name = __FILE__;
+
+typedef struct {
+    char* link;
+    char* title;
+    char* updated;
+    bool current; /* Whether the link is in this run's input */
+} entry_t;
+
+typedef struct {
+    /* Feed level information */
+    char* title;
+    char* id;
+    char* updated;
+
+    /* Entries, in the order they will be written out */
+    entry_t** entries;
+    size_t count;
+    size_t size;
+
+    /* Open addressed hash table of the entries, by link */
+    entry_t** table;
+    size_t table_size; /* Always a power of two, or 0 */
+} feed_t;
+
+
+char* copy_string(char* s, size_t len) {
+    /* Return a newly allocated, null terminated copy of the first "len"
+     * bytes of s.
+     *
+     * This exits on failure.
+     */
+    char* copy = malloc(len + 1);
+    if (copy == NULL) {
+        fprintf(stderr, "%s: malloc(): %s\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+char* unescape(char* s, size_t len) {
+    /* Return a newly allocated copy of the given XML text with the standard
+     * entities (the only ones we ever write) replaced.
+     */
+    static const struct { char* entity; char c; } entities[] = {
+        {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'},
+        {"&apos;", '\''}, {NULL, '\0'},
+    };
+
+    char* result = copy_string(s, len);
+    size_t j = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = s[i];
+        if (c == '&') {
+            for (size_t e = 0; entities[e].entity != NULL; e++) {
+                size_t elen = strlen(entities[e].entity);
+                if (i + elen <= len &&
+                        strncmp(s + i, entities[e].entity, elen) == 0) {
+                    c = entities[e].c;
+                    i += elen - 1;
+                    break;
+                }
+            }
+        }
+        result[j++] = c;
+    }
+    result[j] = '\0';
+    return result;
+}
+
+void print_escaped(FILE* out, char* s) {
+    /* Write the given string, escaping anything XML would choke on */
+    for (; *s != '\0'; s++) {
+        switch (*s) {
+            case '&': fputs("&amp;", out); break;
+            case '<': fputs("&lt;", out); break;
+            case '>': fputs("&gt;", out); break;
+            case '"': fputs("&quot;", out); break;
+            case '\'': fputs("&apos;", out); break;
+            default: putc(*s, out);
+        }
+    }
+}
+
+uint64_t link_hash(char* link) {
+    /* Return the FNV-1a hash of the given link */
+    uint64_t hash = 0xcbf29ce484222325;
+    for (; *link != '\0'; link++) {
+        hash ^= (unsigned char)*link;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+entry_t** find_slot(feed_t* feed, char* link) {
+    /* Return the hash table slot for the given link; this is either the
+     * slot holding it, or the empty slot it would go in.
+     */
+    size_t mask = feed->table_size - 1;
+    size_t i = link_hash(link) & mask;
+    while (feed->table[i] != NULL && strcmp(feed->table[i]->link, link) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &feed->table[i];
+}
+
+entry_t* find_entry(feed_t* feed, char* link) {
+    /* Return the entry with the given link, or NULL if there is none */
+    if (feed->table_size == 0) return NULL;
+    return *find_slot(feed, link);
+}
+
+void index_entries(feed_t* feed, size_t table_size) {
+    /* Rebuild the hash table from the entries, with the given size.
+     *
+     * This exits on failure.
+     */
+    free(feed->table);
+    feed->table = calloc(table_size, sizeof(entry_t*));
+    if (feed->table == NULL) {
+        fprintf(stderr, "%s: calloc(): %s\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    feed->table_size = table_size;
+    for (size_t i = 0; i < feed->count; i++) {
+        *find_slot(feed, feed->entries[i]->link) = feed->entries[i];
+    }
+}
+
+void insert_entry(feed_t* feed, size_t index, entry_t entry) {
+    /* Insert a copy of the given entry before the entry at "index".
+     *
+     * This exits on failure.
+     */
+    entry_t* copy = malloc(sizeof(entry_t));
+    if (copy == NULL) {
+        fprintf(stderr, "%s: malloc(): %s\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    *copy = entry;
+    if (feed->count == feed->size) {
+        feed->size = feed->size == 0 ? 16 : feed->size * 2;
+        feed->entries = realloc(feed->entries,
+                feed->size * sizeof(entry_t*));
+        if (feed->entries == NULL) {
+            fprintf(stderr, "%s: realloc(): %s\n", name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    memmove(&feed->entries[index + 1], &feed->entries[index],
+            (feed->count - index) * sizeof(entry_t*));
+    feed->entries[index] = copy;
+    feed->count++;
+
+    /* Keep the table at most half full */
+    if (feed->count * 2 > feed->table_size) {
+        index_entries(feed, feed->table_size == 0 ? 64 :
+                feed->table_size * 2);
+    } else {
+        *find_slot(feed, copy->link) = copy;
+    }
+}
+
+size_t prune_entries(feed_t* feed) {
+    /* Drop the old entries which are no longer in the input, past the
+     * newest HISTORY_SIZE of them.
+     *
+     * Return the number of entries dropped.
+     */
+    size_t kept = 0;
+    size_t history = 0;
+    for (size_t i = 0; i < feed->count; i++) {
+        entry_t* entry = feed->entries[i];
+        if (entry->current || history++ < HISTORY_SIZE) {
+            feed->entries[kept++] = entry;
+        } else {
+            free(entry->link);
+            free(entry->title);
+            free(entry->updated);
+            free(entry);
+        }
+    }
+    size_t dropped = feed->count - kept;
+    feed->count = kept;
+    if (dropped > 0) index_entries(feed, feed->table_size);
+    return dropped;
+}
+
+char* element_text(char* line, char* element) {
+    /* If the line is a single <element>text</element> pair, return the
+     * unescaped text. Otherwise, return NULL.
+     */
+    size_t len = strlen(element);
+    if (line[0] != '<' || strncmp(line + 1, element, len) != 0 ||
+            line[len + 1] != '>') {
+        return NULL;
+    }
+    char* start = line + len + 2;
+    char* end = strstr(start, "</");
+    if (end == NULL || strncmp(end + 2, element, len) != 0) return NULL;
+    return unescape(start, end - start);
+}
+
+bool load_feed(feed_t* feed, char* path) {
+    /* Load the entries from an existing feed.
+     *
+     * We only need to understand feeds that we wrote ourselves, so this
+     * reads the file a line at a time rather than pulling in an XML parser.
+     * A missing file is treated as an empty feed.
+     *
+     * Return false on failure, true on success.
+     */
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        if (errno == ENOENT) return true;
+        fprintf(stderr, "%s: fopen(%s): %s\n", name, path, strerror(errno));
+        return false;
+    }
+
+    char* line = NULL;
+    size_t line_size = 0;
+    bool in_entry = false;
+    entry_t entry = {NULL, NULL, NULL, false};
+    while (getline(&line, &line_size, file) != -1) {
+        char* s = line + strspn(line, " \t");
+        char* text;
+
+        if (strncmp(s, "<entry>", 7) == 0) {
+            in_entry = true;
+            entry = (entry_t){NULL, NULL, NULL, false};
+        } else if (strncmp(s, "</entry>", 8) == 0) {
+            in_entry = false;
+            if (entry.link != NULL && find_entry(feed, entry.link) == NULL) {
+                if (entry.title == NULL) {
+                    entry.title = copy_string(entry.link, strlen(entry.link));
+                }
+                if (entry.updated == NULL) {
+                    entry.updated = copy_string("", 0);
+                }
+                insert_entry(feed, feed->count, entry);
+            } else {
+                free(entry.link);
+                free(entry.title);
+                free(entry.updated);
+            }
+        } else if ((text = element_text(s, "title")) != NULL) {
+            if (in_entry && entry.title == NULL) entry.title = text;
+            else if (!in_entry && feed->title == NULL) feed->title = text;
+            else free(text);
+        } else if ((text = element_text(s, "id")) != NULL) {
+            if (in_entry && entry.link == NULL) entry.link = text;
+            else if (!in_entry && feed->id == NULL) feed->id = text;
+            else free(text);
+        } else if ((text = element_text(s, "updated")) != NULL) {
+            if (in_entry && entry.updated == NULL) entry.updated = text;
+            else if (!in_entry && feed->updated == NULL) feed->updated = text;
+            else free(text);
+        }
+    }
+    free(line);
+    if (ferror(file)) {
+        fprintf(stderr, "%s: failed to read %s\n", name, path);
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+    return true;
+}
+
+size_t read_links(feed_t* feed, char* date) {
+    /* Read the links from stdin, adding any new ones in order to the top of
+     * the feed, and marking the ones we have as current.
+     *
+     * Return the number of entries added.
+     */
+    char* line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    size_t added = 0;
+    while ((len = getline(&line, &line_size, stdin)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+
+        /* Split into the link and the (optional) title, like "read" does */
+        char* link = line + strspn(line, " ");
+        size_t link_len = strcspn(link, " ");
+        if (link_len == 0) continue;
+        char* title = link + link_len;
+        title += strspn(title, " ");
+        link[link_len] = '\0';
+        if (*title == '\0') title = link;
+
+        entry_t* existing = find_entry(feed, link);
+        if (existing != NULL) {
+            existing->current = true;
+            continue;
+        }
+        entry_t entry = {
+            copy_string(link, strlen(link)),
+            copy_string(title, strlen(title)),
+            copy_string(date, strlen(date)),
+            true,
+        };
+        insert_entry(feed, added, entry);
+        added++;
+    }
+    free(line);
+    return added;
+}
+
+void write_feed(FILE* out, feed_t* feed) {
+    /* Write the feed out in atom format */
+    fprintf(out, "<feed xmlns=\"http://www.w3.org/2005/Atom\">\n");
+    fprintf(out, "    <title>");
+    print_escaped(out, feed->title);
+    fprintf(out, "</title>\n    <id>");
+    print_escaped(out, feed->id);
+    fprintf(out, "</id>\n    <link href=\"");
+    print_escaped(out, feed->id);
+    fprintf(out, "\"></link>\n    <updated>");
+    print_escaped(out, feed->updated);
+    fprintf(out, "</updated>\n");
+
+    for (size_t i = 0; i < feed->count; i++) {
+        entry_t* entry = feed->entries[i];
+        fprintf(out, "    <entry>\n        <title>");
+        print_escaped(out, entry->title);
+        fprintf(out, "</title>\n        <content></content>\n        <id>");
+        print_escaped(out, entry->link);
+        fprintf(out, "</id>\n        <link href=\"");
+        print_escaped(out, entry->link);
+        fprintf(out, "\"></link>\n        <updated>");
+        print_escaped(out, entry->updated);
+        fprintf(out, "</updated>\n    </entry>\n");
+    }
+
+    fprintf(out, "</feed>\n");
+}
+
+bool save_feed(feed_t* feed, char* path) {
+    /* Atomically replace the feed at the given path.
+     *
+     * The new feed is written to a uniquely named file next to the old one
+     * and renamed over it, so concurrent runs never write to the same file.
+     *
+     * Return false on failure, true on success.
+     */
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp)) {
+        fprintf(stderr, "%s: path %s is too long\n", name, path);
+        return false;
+    }
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        fprintf(stderr, "%s: mkstemp(%s): %s\n", name, tmp, strerror(errno));
+        return false;
+    }
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+    FILE* file = fdopen(fd, "w");
+    if (file == NULL) {
+        fprintf(stderr, "%s: fdopen(%s): %s\n", name, tmp, strerror(errno));
+        close(fd);
+        remove(tmp);
+        return false;
+    }
+    write_feed(file, feed);
+    if (ferror(file) | (fclose(file) != 0)) {
+        fprintf(stderr, "%s: failed to write %s\n", name, tmp);
+        remove(tmp);
+        return false;
+    }
+    if (rename(tmp, path) != 0) {
+        fprintf(stderr, "%s: rename(%s): %s\n", name, tmp, strerror(errno));
+        remove(tmp);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 0) name = argv[0];
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "usage: %s <title> <id> [<feed>]\n", name);
+        return EXIT_FAILURE;
+    }
+    char* path = argc == 4 ? argv[3] : NULL;
+
+    char date[DATE_SIZE];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%FT%TZ", gmtime(&now));
+
+    feed_t feed = {NULL, NULL, NULL, NULL, 0, 0, NULL, 0};
+    if (path != NULL && !load_feed(&feed, path)) return EXIT_FAILURE;
+
+    /* Only touch the feed if something changed, so that unchanged feeds keep
+     * their modification time and validate against conditional requests.
+     */
+    bool changed = path == NULL;
+    if (feed.title == NULL || strcmp(feed.title, argv[1]) != 0 ||
+            feed.id == NULL || strcmp(feed.id, argv[2]) != 0) {
+        changed = true;
+    }
+    free(feed.title);
+    free(feed.id);
+    feed.title = argv[1];
+    feed.id = argv[2];
+
+    if (read_links(&feed, date) > 0 || feed.updated == NULL) {
+        changed = true;
+        free(feed.updated);
+        feed.updated = copy_string(date, strlen(date));
+    }
+    if (prune_entries(&feed) > 0) changed = true;
+
+    if (path == NULL) {
+        write_feed(stdout, &feed);
+    } else if (changed && !save_feed(&feed, path)) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,374 @@
+/* manifest.h
+ *
+ * Per-chapter image manifests, written by the scrapers.
+ *
+ * Each chapter directory gets a "manifest" file, with one line per image:
+ *
+ *     <index> <file> <width> <height> <bytes> <sha256>
+ *
+ * The dimensions are sniffed from the image header as it downloads (JPEG,
+ * PNG, GIF, WebP and farbfeld are understood; anything else is 0 0), so tools
+ * can lay out or check a chapter without decoding any of the images. The
+ * scrapers only replace a chapter's manifest once they have every image, so
+ * a failed run leaves the old one alone.
+ *
+ * The farbfeld copies made with -w (see transcode.h) are listed the same way
+ * in a separate "manifest.ff", so the main manifest only ever has the
+ * downloaded images. Each copy has the index of the image it was made from,
+ * but they are listed in the order they were finished.
+ *
+ * Author:  Alastair Hughes
+ * Contact: hobbitalastair at yandex dot com
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sha256.h"
+
+#define MANIFEST_NAME "manifest"
+#define MANIFEST_FF_NAME "manifest.ff" /* For the transcoded copies */
+#define MANIFEST_HEAD 30 /* Header bytes needed for the non-JPEG formats */
+#define MANIFEST_LINE_MAX (NAME_MAX + 128)
+
+typedef enum {
+    SNIFF_HEAD, /* Collecting the first few bytes */
+    SNIFF_JPEG_MARKER, /* Expecting the 0xFF starting a JPEG marker */
+    SNIFF_JPEG_TYPE, /* Expecting the JPEG marker type */
+    SNIFF_JPEG_SEGMENT, /* Collecting the start of a JPEG segment */
+    SNIFF_JPEG_SKIP, /* Skipping the rest of a JPEG segment */
+    SNIFF_DONE, /* Found the dimensions, or gave up */
+} manifest_sniff_state_t;
+
+/* Running state for an image being downloaded */
+typedef struct {
+    sha256_t hash;
+    uint64_t bytes;
+    uint32_t width;
+    uint32_t height;
+
+    manifest_sniff_state_t state;
+    uint8_t buf[MANIFEST_HEAD];
+    size_t buf_len;
+    size_t want; /* Segment bytes wanted, for SNIFF_JPEG_SEGMENT */
+    bool sof; /* Whether the segment is a JPEG start of frame */
+    uint32_t skip; /* Bytes left to skip, for SNIFF_JPEG_SKIP */
+} manifest_stream_t;
+
+/* A single manifest line */
+typedef struct {
+    unsigned int index;
+    char file[NAME_MAX + 1];
+    uint32_t width;
+    uint32_t height;
+    uint64_t bytes;
+    char sha256[SHA256_HEX_SIZE];
+} manifest_entry_t;
+
+/* A manifest read into memory, sorted by file name (see manifest_load) */
+typedef struct {
+    manifest_entry_t* entries;
+    size_t count;
+} manifest_t;
+
+/* Transfer state for downloading an image into a file */
+typedef struct {
+    FILE* file;
+    manifest_stream_t stream;
+} manifest_download_t;
+
+static inline uint32_t manifest_be32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline uint32_t manifest_le24(const uint8_t* p) {
+    return p[0] | p[1] << 8 | (uint32_t)p[2] << 16;
+}
+
+static inline void manifest_sniff_head(manifest_stream_t* s) {
+    /* Find the dimensions of a PNG, GIF, WebP or farbfeld image from the
+     * first bytes.
+     */
+    uint8_t* b = s->buf;
+    size_t len = s->buf_len;
+
+    s->state = SNIFF_DONE;
+    if (len >= 24 && memcmp(b, "\x89PNG\r\n\x1a\n", 8) == 0 &&
+            memcmp(b + 12, "IHDR", 4) == 0) {
+        s->width = manifest_be32(b + 16);
+        s->height = manifest_be32(b + 20);
+    } else if (len >= 16 && memcmp(b, "farbfeld", 8) == 0) {
+        s->width = manifest_be32(b + 8);
+        s->height = manifest_be32(b + 12);
+    } else if (len >= 10 && memcmp(b, "GIF8", 4) == 0) {
+        s->width = b[6] | b[7] << 8;
+        s->height = b[8] | b[9] << 8;
+    } else if (len >= 30 && memcmp(b, "RIFF", 4) == 0 &&
+            memcmp(b + 8, "WEBP", 4) == 0) {
+        if (memcmp(b + 12, "VP8 ", 4) == 0) {
+            s->width = (b[26] | b[27] << 8) & 0x3fff;
+            s->height = (b[28] | b[29] << 8) & 0x3fff;
+        } else if (memcmp(b + 12, "VP8L", 4) == 0) {
+            s->width = 1 + (b[21] | (b[22] & 0x3f) << 8);
+            s->height = 1 + (b[22] >> 6 | b[23] << 2 | (b[24] & 0xf) << 10);
+        } else if (memcmp(b + 12, "VP8X", 4) == 0) {
+            s->width = 1 + manifest_le24(b + 24);
+            s->height = 1 + manifest_le24(b + 27);
+        }
+    }
+}
+
+static inline void manifest_sniff_jpeg(manifest_stream_t* s,
+        uint8_t byte) {
+    /* Step through the JPEG markers, looking for the start of frame */
+    if (s->state == SNIFF_JPEG_MARKER) {
+        s->state = byte == 0xFF ? SNIFF_JPEG_TYPE : SNIFF_DONE;
+    } else if (s->state == SNIFF_JPEG_TYPE) {
+        if (byte == 0xFF) {
+            /* Fill byte */
+        } else if (byte == 0x01 || (byte >= 0xD0 && byte <= 0xD7)) {
+            s->state = SNIFF_JPEG_MARKER; /* No length or contents */
+        } else if (byte == 0xD9 || byte == 0xDA) {
+            s->state = SNIFF_DONE; /* Image data, but no frame header */
+        } else {
+            s->sof = byte >= 0xC0 && byte <= 0xCF && byte != 0xC4 &&
+                byte != 0xC8 && byte != 0xCC;
+            s->want = s->sof ? 7 : 2; /* Length, precision, height, width */
+            s->buf_len = 0;
+            s->state = SNIFF_JPEG_SEGMENT;
+        }
+    } else if (s->state == SNIFF_JPEG_SEGMENT) {
+        s->buf[s->buf_len++] = byte;
+        if (s->buf_len < s->want) return;
+        uint32_t length = s->buf[0] << 8 | s->buf[1];
+        if (s->sof) {
+            s->height = s->buf[3] << 8 | s->buf[4];
+            s->width = s->buf[5] << 8 | s->buf[6];
+            s->state = SNIFF_DONE;
+        } else if (length < 2) {
+            s->state = SNIFF_DONE;
+        } else {
+            s->skip = length - 2;
+            s->state = s->skip > 0 ? SNIFF_JPEG_SKIP : SNIFF_JPEG_MARKER;
+        }
+    }
+}
+
+static inline void manifest_sniff(manifest_stream_t* s,
+        const uint8_t* data, size_t len) {
+    /* Feed the next chunk of the image to the dimension sniffer */
+    size_t i = 0;
+    while (i < len && s->state != SNIFF_DONE) {
+        if (s->state == SNIFF_JPEG_SKIP) {
+            size_t n = len - i < s->skip ? len - i : s->skip;
+            s->skip -= n;
+            i += n;
+            if (s->skip == 0) s->state = SNIFF_JPEG_MARKER;
+        } else if (s->state == SNIFF_HEAD) {
+            s->buf[s->buf_len++] = data[i++];
+            if (s->buf_len == 2 && s->buf[0] == 0xFF && s->buf[1] == 0xD8) {
+                s->state = SNIFF_JPEG_MARKER;
+            } else if (s->buf_len == MANIFEST_HEAD) {
+                manifest_sniff_head(s);
+            }
+        } else {
+            manifest_sniff_jpeg(s, data[i++]);
+        }
+    }
+}
+
+static inline void manifest_stream_init(manifest_stream_t* s) {
+    sha256_init(&s->hash);
+    s->bytes = 0;
+    s->width = 0;
+    s->height = 0;
+    s->state = SNIFF_HEAD;
+    s->buf_len = 0;
+}
+
+static inline void manifest_stream_update(manifest_stream_t* s,
+        const void* data, size_t len) {
+    sha256_update(&s->hash, data, len);
+    s->bytes += len;
+    manifest_sniff(s, data, len);
+}
+
+static inline void manifest_stream_finish(manifest_stream_t* s,
+        manifest_entry_t* entry) {
+    /* Fill in the dimensions, size and checksum for the finished image */
+    uint8_t digest[SHA256_SIZE];
+
+    if (s->state == SNIFF_HEAD) manifest_sniff_head(s); /* A tiny image */
+    sha256_final(&s->hash, digest);
+    sha256_hex(digest, entry->sha256);
+    entry->bytes = s->bytes;
+    entry->width = s->width;
+    entry->height = s->height;
+}
+
+static inline size_t manifest_write(char* ptr, size_t size,
+        size_t nmemb, void* data) {
+    /* Curl write callback, saving the image and updating the stream */
+    manifest_download_t* d = (manifest_download_t*)data;
+    manifest_stream_update(&d->stream, ptr, size * nmemb);
+    return fwrite(ptr, 1, size * nmemb, d->file);
+}
+
+/* Fill in the dimensions and size of an existing image file.
+ *
+ * Only the header is read, so this is cheap even for large images.
+ * Returns true on success, false otherwise.
+ */
+static inline bool manifest_sniff_file(char* path,
+        manifest_entry_t* entry) {
+    manifest_stream_t s;
+    uint8_t buf[4096];
+    struct stat st;
+    ssize_t count;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return false;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return false;
+    }
+    manifest_stream_init(&s);
+    while (s.state != SNIFF_DONE && (count = read(fd, buf, sizeof(buf))) > 0) {
+        manifest_sniff(&s, buf, count);
+    }
+    close(fd);
+    if (s.state == SNIFF_HEAD) manifest_sniff_head(&s);
+    entry->bytes = st.st_size;
+    entry->width = s.width;
+    entry->height = s.height;
+    return true;
+}
+
+/* Start writing a new manifest with the given name in the given directory.
+ *
+ * The manifest is written to a temporary file, and only replaces the old one
+ * in manifest_commit. Returns NULL on failure.
+ */
+static inline FILE* manifest_create(char* dir, char* name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s.tmp", dir, name);
+    FILE* manifest = fopen(path, "w");
+    if (manifest == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+    }
+    return manifest;
+}
+
+static inline void manifest_add(FILE* manifest,
+        manifest_entry_t* entry) {
+    fprintf(manifest, "%u %s %u %u %llu %s\n", entry->index, entry->file,
+            entry->width, entry->height, (unsigned long long)entry->bytes,
+            entry->sha256);
+}
+
+/* Finish a manifest from manifest_create, replacing any old one.
+ *
+ * Returns true on success, false otherwise.
+ */
+static inline bool manifest_commit(FILE* manifest, char* dir, char* name) {
+    char tmp[PATH_MAX + 8];
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (fclose(manifest) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return false;
+    }
+    if (rename(tmp, path) == -1) {
+        fprintf(stderr, "failed to rename %s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+/* Throw away a manifest from manifest_create, keeping any old one */
+static inline void manifest_abort(FILE* manifest, char* dir, char* name) {
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s/%s.tmp", dir, name);
+    fclose(manifest);
+    unlink(tmp);
+}
+
+static inline int manifest_compare(const void* a, const void* b) {
+    return strcmp(((manifest_entry_t*)a)->file, ((manifest_entry_t*)b)->file);
+}
+
+/* Read the manifest at the given path into memory, so that each image can be
+ * looked up without reading it again.
+ *
+ * Returns false if it couldn't be read, leaving the manifest empty.
+ */
+static inline bool manifest_load(char* path, manifest_t* manifest) {
+    char line[MANIFEST_LINE_MAX];
+    unsigned long long bytes;
+    size_t size = 0;
+
+    manifest->entries = NULL;
+    manifest->count = 0;
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return false;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (manifest->count == size) {
+            size = size == 0 ? 64 : size * 2;
+            manifest_entry_t* entries = realloc(manifest->entries,
+                    size * sizeof(manifest_entry_t));
+            if (entries == NULL) break;
+            manifest->entries = entries;
+        }
+        manifest_entry_t* entry = &manifest->entries[manifest->count];
+        if (sscanf(line, "%u %255s %u %u %llu %64s", &entry->index,
+                    entry->file, &entry->width, &entry->height, &bytes,
+                    entry->sha256) != 6) {
+            continue;
+        }
+        entry->bytes = bytes;
+        manifest->count++;
+    }
+    fclose(file);
+    if (manifest->count > 0) {
+        qsort(manifest->entries, manifest->count, sizeof(manifest_entry_t),
+                manifest_compare);
+    }
+    return true;
+}
+
+/* Find the given file in a manifest from manifest_load.
+ *
+ * Returns NULL if it isn't listed.
+ */
+static inline manifest_entry_t* manifest_find(manifest_t* manifest,
+        char* file) {
+    manifest_entry_t key;
+    if (manifest->count == 0 || strlen(file) >= sizeof(key.file)) {
+        return NULL;
+    }
+    strcpy(key.file, file);
+    return bsearch(&key, manifest->entries, manifest->count,
+            sizeof(manifest_entry_t), manifest_compare);
+}
+
+static inline void manifest_free(manifest_t* manifest) {
+    free(manifest->entries);
+    manifest->entries = NULL;
+    manifest->count = 0;
+}
+
+#endif /* MANIFEST_H */
@@ -0,0 +1,249 @@
+/* memstat.h
+ *
+ * Optional memory accounting, enabled by building with "make MEMSTAT=1".
+ *
+ * This replaces the malloc family for the whole process (including libcurl,
+ * libhubbub and libnsfb), so every allocation is counted. Allocations are
+ * charged to whichever subsystem was last entered with memstat_enter() on
+ * the current thread, and are freed from the subsystem they were charged to.
+ *
+ * At exit the live and peak bytes for each subsystem are printed to stderr,
+ * along with the peak RSS. If the peak RSS is over the budget (MEMSTAT_BUDGET
+ * bytes, or the value of the MEMSTAT_BUDGET environment variable) the
+ * process exits with a failure status instead, so scripts can catch
+ * regressions of the RAM usage goal.
+ *
+ * Without MEMSTAT, memstat_enter() and memstat_leave() do nothing.
+ *
+ * This is only meant to be included once per program.
+ *
+ * Author:  Alastair Hughes
+ * Contact: hobbitalastair at yandex dot com
+ */
+
+#ifndef MEMSTAT_H
+#define MEMSTAT_H
+
+/* Subsystems which allocations can be charged to */
+typedef enum {
+    MEM_OTHER,
+    MEM_FRAMEBUFFER,
+    MEM_CACHE,
+    MEM_PARSER,
+    MEM_CURL,
+    MEM_SUBSYSTEMS, /* Number of subsystems */
+} mem_subsystem_t;
+
+#ifndef MEMSTAT
+
+static inline mem_subsystem_t memstat_enter(mem_subsystem_t s) {
+    return MEM_OTHER;
+}
+
+static inline void memstat_leave(mem_subsystem_t previous) {}
+
+#else
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#ifndef MEMSTAT_BUDGET
+#define MEMSTAT_BUDGET (6 * 1024 * 1024) /* RAM usage goal from the README */
+#endif
+
+/* The real allocator, which glibc exports under these names */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void* ptr);
+
+/* Header stored before every allocation.
+ *
+ * This is 16 bytes so that the returned pointers keep malloc's alignment.
+ */
+typedef struct {
+    size_t size; /* Requested size */
+    uint32_t subsystem; /* Subsystem the allocation is charged to */
+    uint32_t offset; /* Distance from the start of the real allocation */
+} memstat_header_t;
+
+static char* memstat_names[MEM_SUBSYSTEMS] = {
+    "other", "framebuffer", "cache", "parser", "curl",
+};
+static size_t memstat_live[MEM_SUBSYSTEMS];
+static size_t memstat_peak[MEM_SUBSYSTEMS];
+static size_t memstat_total_live;
+static size_t memstat_total_peak;
+static __thread mem_subsystem_t memstat_current = MEM_OTHER;
+
+static inline mem_subsystem_t memstat_enter(mem_subsystem_t s) {
+    /* Charge allocations to the given subsystem, returning the previous one
+     * to pass to memstat_leave().
+     */
+    mem_subsystem_t previous = memstat_current;
+    memstat_current = s;
+    return previous;
+}
+
+static inline void memstat_leave(mem_subsystem_t previous) {
+    memstat_current = previous;
+}
+
+static void memstat_update_peak(size_t* peak, size_t live) {
+    size_t old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (live > old && !__atomic_compare_exchange_n(peak, &old, live,
+                true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void* memstat_track(void* raw, size_t offset, size_t size) {
+    /* Fill in the header for a new allocation and account for it */
+    if (raw == NULL) return NULL;
+    memstat_header_t* h = (memstat_header_t*)((char*)raw + offset) - 1;
+    h->size = size;
+    h->subsystem = memstat_current;
+    h->offset = offset;
+
+    size_t live = __atomic_add_fetch(&memstat_live[h->subsystem], size,
+            __ATOMIC_RELAXED);
+    memstat_update_peak(&memstat_peak[h->subsystem], live);
+    live = __atomic_add_fetch(&memstat_total_live, size, __ATOMIC_RELAXED);
+    memstat_update_peak(&memstat_total_peak, live);
+    return (char*)raw + offset;
+}
+
+static memstat_header_t* memstat_untrack(void* ptr) {
+    /* Remove an allocation from the accounting, returning its header */
+    memstat_header_t* h = (memstat_header_t*)ptr - 1;
+    __atomic_sub_fetch(&memstat_live[h->subsystem], h->size,
+            __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&memstat_total_live, h->size, __ATOMIC_RELAXED);
+    return h;
+}
+
+void* malloc(size_t size) {
+    if (size > SIZE_MAX - sizeof(memstat_header_t)) return NULL;
+    return memstat_track(__libc_malloc(size + sizeof(memstat_header_t)),
+            sizeof(memstat_header_t), size);
+}
+
+void free(void* ptr) {
+    if (ptr == NULL) return;
+    memstat_header_t* h = memstat_untrack(ptr);
+    __libc_free((char*)ptr - h->offset);
+}
+
+void* calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void* ptr = malloc(count * size);
+    if (ptr != NULL) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (ptr == NULL) return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (size > SIZE_MAX - sizeof(memstat_header_t)) return NULL;
+
+    memstat_header_t* h = (memstat_header_t*)ptr - 1;
+    if (h->offset != sizeof(memstat_header_t)) {
+        /* Aligned allocations can't be passed to the real realloc */
+        void* new = malloc(size);
+        if (new == NULL) return NULL;
+        memcpy(new, ptr, h->size < size ? h->size : size);
+        free(ptr);
+        return new;
+    }
+
+    /* Keep the original subsystem for the resized allocation */
+    mem_subsystem_t subsystem = h->subsystem;
+    size_t old_size = h->size;
+    memstat_untrack(ptr);
+    void* raw = __libc_realloc(h, size + sizeof(memstat_header_t));
+    mem_subsystem_t previous = memstat_enter(subsystem);
+    void* new = memstat_track(raw == NULL ? (void*)h : raw,
+            sizeof(memstat_header_t), raw == NULL ? old_size : size);
+    memstat_leave(previous);
+    return raw == NULL ? NULL : new;
+}
+
+void* memalign(size_t alignment, size_t size) {
+    if (alignment <= sizeof(memstat_header_t)) return malloc(size);
+    if ((alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (size > SIZE_MAX - alignment) return NULL;
+    return memstat_track(__libc_memalign(alignment, size + alignment),
+            alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* new = memalign(alignment, size);
+    if (new == NULL) return ENOMEM;
+    *ptr = new;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+void* valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void* ptr) {
+    if (ptr == NULL) return 0;
+    return ((memstat_header_t*)ptr - 1)->size;
+}
+
+static void memstat_report(void) {
+    /* Print the accounting, and fail if we went over the budget */
+    for (int i = 0; i < MEM_SUBSYSTEMS; i++) {
+        fprintf(stderr, "memstat: %-12s live %10zu peak %10zu\n",
+                memstat_names[i], memstat_live[i], memstat_peak[i]);
+    }
+    fprintf(stderr, "memstat: %-12s live %10zu peak %10zu\n", "total",
+            memstat_total_live, memstat_total_peak);
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return;
+    size_t rss = (size_t)usage.ru_maxrss * 1024;
+    size_t budget = MEMSTAT_BUDGET;
+    if (getenv("MEMSTAT_BUDGET") != NULL) {
+        budget = strtoull(getenv("MEMSTAT_BUDGET"), NULL, 10);
+    }
+    fprintf(stderr, "memstat: peak rss %zu (budget %zu)\n", rss, budget);
+    if (rss > budget) {
+        fprintf(stderr, "memstat: over budget!\n");
+        _exit(EXIT_FAILURE);
+    }
+}
+
+__attribute__((constructor)) static void memstat_init(void) {
+    atexit(memstat_report);
+}
+
+#endif /* MEMSTAT */
+#endif /* MEMSTAT_H */
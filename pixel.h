@@ -0,0 +1,126 @@
+/* pixel.h
+ *
+ * Pixel conversion and plotting kernels for comic-viewer.
+ *
+ * These are kept separate so that comic-viewer-bench can time exactly the
+ * code the viewer runs, without needing a display.
+ *
+ * Author:  Alastair Hughes
+ * Contact: hobbitalastair at yandex dot com
+ */
+
+#ifndef PIXEL_H
+#define PIXEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libnsfb.h>
+
+static inline void farbfeld_to_rgbx(const uint8_t *in, uint8_t *out,
+        size_t pixels) {
+    /* Convert farbfeld pixels (16 bit big endian RGBA) into 8 bit RGBX by
+     * keeping the high byte of each channel.
+     */
+    for (size_t i = 0; i < pixels; i++) {
+        out[4*i + 0] = in[8*i + 0];
+        out[4*i + 1] = in[8*i + 2];
+        out[4*i + 2] = in[8*i + 4];
+        out[4*i + 3] = 0;
+    }
+}
+
+static inline int scale_to_display(int pos, float scale_factor, int offset) {
+    /* Map an image row or column to the display, given the scale factor
+     * (where values over 1 shrink the image) and scroll offset.
+     */
+    return (pos / scale_factor) - offset;
+}
+
+static inline bool row_visible(int display_y, int clip_top,
+        int clip_bottom) {
+    /* Return true if the given display row is within the clip rows */
+    return display_y >= clip_top && display_y < clip_bottom;
+}
+
+static inline int format_swap(enum nsfb_format_e format) {
+    /* Return 1 if the display format stores pixels as B, G, R, 0 if it
+     * stores them as R, G, B, or -1 if it isn't one we support.
+     *
+     * The formats are named for 32 bit words, so on our (little endian)
+     * displays the bytes of XRGB are stored B, G, R.
+     */
+    if (format == NSFB_FMT_RGB888 || format == NSFB_FMT_ARGB8888 ||
+            format == NSFB_FMT_XRGB8888) {
+        return 1;
+    } else if (format == NSFB_FMT_ABGR8888 || format == NSFB_FMT_XBGR8888) {
+        return 0;
+    }
+    return -1;
+}
+
+static inline void fill_row(uint8_t *dest, enum nsfb_format_e format,
+        uint32_t colour, int width, size_t row_bytes) {
+    /* Fill a display row (row_bytes long) with the given libnsfb (ABGR)
+     * colour.
+     *
+     * We don't know the layout of other formats, so those get every byte
+     * set to the colour's grey level instead; that is still right for black
+     * and white, and at least leaves nothing behind from the last frame.
+     */
+    int swap = format_swap(format);
+    uint8_t r = colour, g = colour >> 8, b = colour >> 16;
+    if (swap == -1) {
+        memset(dest, (r + g + b) / 3, row_bytes);
+        return;
+    }
+    for (int x = 0; x < width; x++) {
+        uint8_t *p = dest + x * 4;
+        p[0] = swap ? b : r;
+        p[1] = g;
+        p[2] = swap ? r : b;
+        p[3] = 0xFF;
+    }
+}
+
+static inline void store_row(uint8_t *dest, enum nsfb_format_e format,
+        const uint8_t *rgbx, uint32_t width, float scale_factor,
+        int offset_x, int display_width) {
+    /* Store a row of 8 bit RGBX pixels into a display row.
+     *
+     * The row is scaled and clipped to the display width; when shrinking,
+     * the last pixel mapping to a display column wins.
+     */
+    int swap = format_swap(format); /* Whether to store as B, G, R */
+    if (swap == -1) return; /* Unsupported format */
+
+    /* Skip straight to the first visible column */
+    uint32_t x = 0;
+    if (offset_x > 0) {
+        x = offset_x * scale_factor;
+        while (x > 0 && scale_to_display(x - 1, scale_factor, offset_x) >= 0) {
+            x--;
+        }
+    }
+
+    for (; x < width; x++) {
+        int display_x = scale_to_display(x, scale_factor, offset_x);
+        if (display_x < 0) continue;
+        if (display_x >= display_width) break;
+        uint8_t *p = dest + display_x * 4;
+        const uint8_t *s = rgbx + x * 4;
+        if (swap) {
+            p[0] = s[2];
+            p[1] = s[1];
+            p[2] = s[0];
+        } else {
+            p[0] = s[0];
+            p[1] = s[1];
+            p[2] = s[2];
+        }
+    }
+}
+
+#endif /* PIXEL_H */
@@ -2,10 +2,20 @@
  *
  * Experimental www.webtoons.com scraper/downloader.
  *
+ * With -f, the image list is read from the much smaller mobile version of
+ * the page first (or from the URL given with -j), using a simple streaming
+ * scanner instead of the HTML parser. If that doesn't find any images we
+ * fall back to parsing the full page. Pages which aren't on DESKTOP_HOST
+ * have no mobile version, so -f parses them straight away.
+ *
+ * With --serve [<socket>], run as a resident server instead (see serve.h).
+ *
  * Author:  Alastair Hughes
  * Contact: hobbitalastair at yandex dot com
  */
 
+#define _GNU_SOURCE
+#include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -14,45 +24,188 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include <curl/curl.h>
 #include <hubbub/hubbub.h>
 #include <hubbub/parser.h>
 
+#include "manifest.h"
+#include "memstat.h"
+#include "serve.h"
+#include "store.h"
+#include "transcode.h"
+
+#define IMAGE_LIST_MARKER "imageList" // Precedes the image list.
+#define CONTAINER_ID "_imageList" // Id of the element holding the images.
+#define SCAN_STRING_MAX 2048 // Longest image URL we will handle.
+#define SCAN_KEY_MAX 16 // Longest key we need to recognise, plus one.
+#define TAG_STACK 64 // Open elements to remember the names of.
+#define TAG_NAME_MAX 32 // Longest element name we remember, plus one.
+#define DESKTOP_HOST "://www.webtoons.com/"
+#define MOBILE_HOST "://m.webtoons.com/"
+#define MOBILE_USER_AGENT \
+    "Mozilla/5.0 (Linux; Android 10; Mobile) AppleWebKit/537.36 " \
+    "(KHTML, like Gecko) Chrome/120.0 Mobile Safari/537.36"
+
 char path[PATH_MAX + 1];
 
+/* Curl handles, kept between transfers so that connections get reused */
+CURL* page_curl = NULL;
+CURL* image_curl = NULL;
+
+/* State for the image list scanner (see scan_list) */
+typedef enum {
+    SCAN_MARKER, // Looking for IMAGE_LIST_MARKER.
+    SCAN_OPEN, // Looking for the opening bracket of the list.
+    SCAN_LIST, // Inside the list.
+    SCAN_STRING, // Inside a string in the list.
+    SCAN_ESCAPE, // After a backslash in a string.
+    SCAN_UNICODE, // Inside a \uXXXX escape.
+} ScanState;
+
+typedef struct {
+    ScanState state;
+    size_t matched; // Characters of the marker matched so far.
+    int depth; // Bracket depth inside the list.
+    char quote; // Quote character for the current string.
+    char string[SCAN_STRING_MAX]; // Current string.
+    size_t string_len;
+    bool overflow; // Set if the current string didn't fit.
+    unsigned int code; // Value of the current \u escape.
+    int code_digits; // Digits of the current \u escape seen so far.
+    char key[SCAN_KEY_MAX]; // Last bare word or short string seen.
+    bool expect_url; // Set if the next string is the value of a url key.
+} Scanner;
+
 /* Wrapper containing page-specific information */
 typedef struct {
     hubbub_parser *parser; // Parser for the main page.
     char* url; // Main page URL.
     unsigned int count; // Images downloaded so far.
     char* path; // Path to download images into.
+    unsigned int limit; // Maximum images to download, or 0 for no limit.
+    bool stop_at_end; // Stop once the element holding the images closes.
+    int depth; // Depth of the current element in the page.
+    char open_tags[TAG_STACK][TAG_NAME_MAX]; // Names of the open elements.
+    bool containers[TAG_STACK]; // Which open elements hold the images.
+    int region_depth; // Depth of the image container, or -1 if not found.
+    bool done; // Set once we have everything; aborts the transfer.
+    bool failed; // Set if any image couldn't be downloaded.
+    char* store; // Content-addressed image store, or NULL.
+    FILE* manifest; // Chapter manifest being written, or NULL.
+    transcode_t* transcode; // Pool to transcode images with, or NULL.
+    Scanner scan; // Image list scanner state, for the fast path.
 } Page;
 
+/* Elements which never have an end tag, so don't count towards the depth */
+char* void_elements[] = {
+    "area", "base", "br", "col", "embed", "hr", "img", "input", "link",
+    "meta", "param", "source", "track", "wbr", NULL,
+};
+
 /* Compare a hubbub string and a C string - returns true if equal */
 bool string_equal(hubbub_string h, char* c) {
     return (strlen(c) == h.len) && strncmp((char*)h.ptr, c, h.len) == 0;
 }
 
-/* Download the image at the given url */
+/* Return true if the given tag never has a matching end tag */
+bool is_void_tag(hubbub_tag tag) {
+    for (size_t i = 0; void_elements[i] != NULL; i++) {
+        if (string_equal(tag.name, void_elements[i])) return true;
+    }
+    return tag.self_closing;
+}
+
+/* Return true if the name of an open element matches the given tag name */
+bool tag_matches(char* open, hubbub_string name) {
+    size_t len = name.len < TAG_NAME_MAX - 1 ? name.len : TAG_NAME_MAX - 1;
+    return strlen(open) == len && strncmp(open, (char*)name.ptr, len) == 0;
+}
+
+/* Return true if the given element is the one holding the images */
+bool is_container(hubbub_tag tag) {
+    for (size_t i = 0; i < tag.n_attributes; i++) {
+        if (string_equal(tag.attributes[i].name, "id") &&
+                string_equal(tag.attributes[i].value, CONTAINER_ID)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Record a newly opened element */
+void open_tag(Page* p, hubbub_tag tag) {
+    if (p->depth < TAG_STACK) {
+        size_t len = tag.name.len < TAG_NAME_MAX - 1 ? tag.name.len :
+            TAG_NAME_MAX - 1;
+        memcpy(p->open_tags[p->depth], tag.name.ptr, len);
+        p->open_tags[p->depth][len] = '\0';
+        p->containers[p->depth] = is_container(tag);
+    }
+    p->depth++;
+}
+
+/* Return the depth of the element holding the images, given that we are at
+ * one of them: the innermost open container, if there is one, or else the
+ * image's parent. Each image can have a wrapper of its own, so the parent is
+ * only a last resort.
+ */
+int find_region(Page* p) {
+    int top = p->depth < TAG_STACK ? p->depth : TAG_STACK;
+    for (int i = top - 1; i >= 0; i--) {
+        if (p->containers[i]) return i + 1;
+    }
+    return p->depth;
+}
+
+/* Close the innermost open element with the given name, and anything still
+ * open inside it. Stray end tags which don't match anything are ignored.
+ */
+void close_tag(Page* p, hubbub_string name) {
+    if (p->depth > TAG_STACK) {
+        p->depth--; // Too deep to know the names, so take it as given.
+        return;
+    }
+    for (int i = p->depth - 1; i >= 0; i--) {
+        if (tag_matches(p->open_tags[i], name)) {
+            p->depth = i;
+            return;
+        }
+    }
+}
+
+/* Return the given curl handle ready for a new transfer, or NULL on failure.
+ *
+ * The handle is reset rather than recreated, which keeps its connections
+ * open for the next transfer.
+ */
+CURL* get_handle(CURL** handle) {
+    if (*handle == NULL) {
+        *handle = curl_easy_init();
+    } else {
+        curl_easy_reset(*handle);
+    }
+    return *handle;
+}
+
+/* Download the image at the given url, adding it to the manifest */
 bool download_image(Page* p, hubbub_string url) {
     CURL *curl;
     CURLcode result;
     bool ok = true;
     size_t i;
-    FILE* file;
+    manifest_download_t d;
+    manifest_entry_t entry;
     char* url_string;
+    char tmp[PATH_MAX + 8];
 
     printf("%.*s, %d\n", (int)url.len, url.ptr, p->count);
 
-    /* Open the file to write to */
-    snprintf(path, PATH_MAX + 1, "%s/%03d.jpg", p->path, p->count);
+    entry.index = p->count;
+    snprintf(entry.file, sizeof(entry.file), "%03d.jpg", p->count);
+    snprintf(path, PATH_MAX + 1, "%s/%s", p->path, entry.file);
     path[PATH_MAX] = '\0';
-    file = fopen(path, "w+");
-    if (file == NULL) {
-        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
-        return false;
-    }
 
     /* Create the url buffer */
     url_string = malloc(url.len + 1);
@@ -66,25 +219,60 @@ bool download_image(Page* p, hubbub_string url) {
     url_string[i] = '\0'; // Null terminate the buffer!
 
     /* Init curl */
-    curl = curl_easy_init();
+    mem_subsystem_t previous = memstat_enter(MEM_CURL);
+    curl = get_handle(&image_curl);
     if (!curl) {
+        memstat_leave(previous);
         free(url_string);
         return false;
     }
 
-    /* Download the page */
-    curl_easy_setopt(curl, CURLOPT_URL, url_string);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, file);
-    curl_easy_setopt(curl, CURLOPT_REFERER, p->url);
-    result = curl_easy_perform(curl);
-    if (result != CURLE_OK) {
-        fprintf(stderr, "failed to retrieve %.*s: %s\n", (int)url.len, url.ptr,
-                curl_easy_strerror(result));
-        ok = false;
+    if (p->store != NULL) {
+        /* Go through the store, which skips the download for known urls */
+        ok = store_fetch(curl, p->store, url_string, p->url, path, &entry);
+        memstat_leave(previous);
+    } else {
+        /* Download next to the file and rename it into place, since the
+         * file there now may be a link to an image in a store.
+         */
+        snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+        d.file = store_tmpfile(tmp);
+        if (d.file == NULL) {
+            memstat_leave(previous);
+            free(url_string);
+            return false;
+        }
+        manifest_stream_init(&d.stream);
+
+        /* Download the image */
+        curl_easy_setopt(curl, CURLOPT_URL, url_string);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, manifest_write);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &d);
+        curl_easy_setopt(curl, CURLOPT_REFERER, p->url);
+        result = curl_easy_perform(curl);
+        if (result != CURLE_OK) {
+            fprintf(stderr, "failed to retrieve %.*s: %s\n", (int)url.len,
+                    url.ptr, curl_easy_strerror(result));
+            ok = false;
+        }
+        memstat_leave(previous);
+        if (fclose(d.file) != 0) {
+            fprintf(stderr, "failed to write %s: %s\n", tmp, strerror(errno));
+            ok = false;
+        }
+        if (ok && rename(tmp, path) == -1) {
+            fprintf(stderr, "failed to rename %s: %s\n", tmp, strerror(errno));
+            ok = false;
+        }
+        if (!ok) unlink(tmp);
+        manifest_stream_finish(&d.stream, &entry);
     }
 
     /* Clean up */
-    curl_easy_cleanup(curl);
+    if (ok && p->manifest != NULL) manifest_add(p->manifest, &entry);
+    if (ok && p->transcode != NULL) {
+        transcode_add(p->transcode, path, p->path, entry.index);
+    }
     free(url_string);
     p->count++;
     return ok;
@@ -103,8 +291,18 @@ hubbub_error token_handler(const hubbub_token *token, void *pw) {
     size_t i;
     Page* p = (Page*)pw;
 
-    if (token->type == HUBBUB_TOKEN_START_TAG) {
+    /* Anything left in the current chunk once we are done is ignored */
+    if (p->done) return HUBBUB_OK;
+
+    if (token->type == HUBBUB_TOKEN_END_TAG) {
+        close_tag(p, token->data.tag.name);
+        if (p->stop_at_end && p->region_depth != -1 &&
+                p->depth < p->region_depth) {
+            p->done = true;
+        }
+    } else if (token->type == HUBBUB_TOKEN_START_TAG) {
         tag = token->data.tag;
+        if (!is_void_tag(tag)) open_tag(p, tag);
         if (string_equal(tag.name, "img")) {
             class.ptr = NULL;
             data_url.ptr = NULL;
@@ -117,7 +315,12 @@ hubbub_error token_handler(const hubbub_token *token, void *pw) {
             }
             if (class.ptr != NULL && data_url.ptr != NULL &&
                     string_equal(class, "_images")) {
-                download_image(p, data_url);
+                /* The images all sit in the same element, so remember
+                 * where that is to find the end of the list.
+                 */
+                if (p->region_depth == -1) p->region_depth = find_region(p);
+                if (!download_image(p, data_url)) p->failed = true;
+                if (p->limit != 0 && p->count >= p->limit) p->done = true;
             }
         }
     }
@@ -128,23 +331,256 @@ hubbub_error token_handler(const hubbub_token *token, void *pw) {
  *
  * This will ignore failures from the hubbub parser.
  * If that turns out to be bad, return a number not equal to size * nmemb.
+ * Once the token handler has found everything we are after we do exactly
+ * that, which makes curl abort the rest of the transfer.
  */
 size_t write_page(char* ptr, size_t size, size_t nmemb, void *data) {
-    Page p = *((Page*)data);
+    Page* p = (Page*)data;
 
-    int res = hubbub_parser_parse_chunk(p.parser, (unsigned char*)ptr, size * nmemb);
+    if (p->done) return 0;
+    mem_subsystem_t previous = memstat_enter(MEM_PARSER);
+    int res = hubbub_parser_parse_chunk(p->parser, (unsigned char*)ptr, size * nmemb);
+    memstat_leave(previous);
     if (res != HUBBUB_OK)
     {
         fprintf(stderr, "Failed to parse page, got %d\n", res);
     }
+    if (p->done) return 0; // Don't wait for another chunk to stop.
+    return size * nmemb;
+}
+
+/* Add a character to the scanner's current string */
+void scan_append(Scanner* s, char c) {
+    if (s->string_len + 1 < SCAN_STRING_MAX) {
+        s->string[s->string_len++] = c;
+    } else {
+        s->overflow = true;
+    }
+}
+
+/* Handle the end of a string in the image list */
+void scan_string_end(Page* p) {
+    Scanner* s = &p->scan;
+    hubbub_string url;
+
+    s->state = SCAN_LIST;
+    if (s->expect_url) {
+        s->expect_url = false;
+        if (s->overflow) {
+            fprintf(stderr, "ignoring overlong image url\n");
+        } else if (s->string_len > 0) {
+            url.ptr = (uint8_t*)s->string;
+            url.len = s->string_len;
+            if (!download_image(p, url)) p->failed = true;
+            if (p->limit != 0 && p->count >= p->limit) p->done = true;
+        }
+    } else if (!s->overflow && s->string_len < SCAN_KEY_MAX) {
+        memcpy(s->key, s->string, s->string_len);
+        s->key[s->string_len] = '\0';
+    } else {
+        s->key[0] = '\0';
+    }
+}
+
+/* Scan a chunk of the image list.
+ *
+ * This is a small streaming scanner for the JSON (or JavaScript) image list
+ * which the mobile pages and the list endpoints use, something like:
+ *
+ *     imageList = [{"url": "https:\/\/...", ...}, {url: '...'}, ...]
+ *
+ * It skips to IMAGE_LIST_MARKER followed by a "[" (with nothing but
+ * whitespace, quotes, "=" or ":" in between), then downloads the value of
+ * every "url" key until the list closes, at which point it marks the page as
+ * done. It only keeps one string at a time, so it doesn't matter how the
+ * list is split up between chunks.
+ */
+void scan_list(Page* p, const char* data, size_t len) {
+    Scanner* s = &p->scan;
+
+    for (size_t i = 0; i < len && !p->done; i++) {
+        char c = data[i];
+        switch (s->state) {
+            case SCAN_MARKER:
+                if (c == IMAGE_LIST_MARKER[s->matched]) {
+                    s->matched++;
+                } else {
+                    s->matched = c == IMAGE_LIST_MARKER[0] ? 1 : 0;
+                }
+                if (IMAGE_LIST_MARKER[s->matched] == '\0') {
+                    s->state = SCAN_OPEN;
+                }
+                break;
+            case SCAN_OPEN:
+                if (c == '[') {
+                    s->state = SCAN_LIST;
+                    s->depth = 1;
+                    s->key[0] = '\0';
+                    s->expect_url = false;
+                } else if (!isspace((unsigned char)c) && c != '"' &&
+                        c != '\'' && c != '=' && c != ':') {
+                    /* Just a mention, like id="_imageList"; keep looking */
+                    s->state = SCAN_MARKER;
+                    s->matched = c == IMAGE_LIST_MARKER[0] ? 1 : 0;
+                }
+                break;
+            case SCAN_LIST:
+                if (c == '"' || c == '\'') {
+                    s->state = SCAN_STRING;
+                    s->quote = c;
+                    s->string_len = 0;
+                    s->overflow = false;
+                } else if (c == ':') {
+                    s->expect_url = strcmp(s->key, "url") == 0;
+                    s->key[0] = '\0';
+                } else if (c == '[' || c == '{') {
+                    s->depth++;
+                    s->key[0] = '\0';
+                    s->expect_url = false;
+                } else if (c == ']' || c == '}') {
+                    s->depth--;
+                    if (s->depth == 0) p->done = true;
+                    s->key[0] = '\0';
+                    s->expect_url = false;
+                } else if (isalnum((unsigned char)c) || c == '_' || c == '$') {
+                    /* Part of a bare (JavaScript style) key */
+                    size_t key_len = strlen(s->key);
+                    if (key_len + 1 < SCAN_KEY_MAX) {
+                        s->key[key_len] = c;
+                        s->key[key_len + 1] = '\0';
+                    }
+                } else if (!isspace((unsigned char)c)) {
+                    s->key[0] = '\0';
+                    s->expect_url = false;
+                }
+                break;
+            case SCAN_STRING:
+                if (c == '\\') {
+                    s->state = SCAN_ESCAPE;
+                } else if (c == s->quote) {
+                    scan_string_end(p);
+                } else {
+                    scan_append(s, c);
+                }
+                break;
+            case SCAN_ESCAPE:
+                s->state = SCAN_STRING;
+                if (c == 'u') {
+                    s->state = SCAN_UNICODE;
+                    s->code = 0;
+                    s->code_digits = 0;
+                } else if (c == 'n') {
+                    scan_append(s, '\n');
+                } else if (c == 't') {
+                    scan_append(s, '\t');
+                } else {
+                    scan_append(s, c); // Covers \/, \\, \" and \'
+                }
+                break;
+            case SCAN_UNICODE:
+                if (!isxdigit((unsigned char)c)) {
+                    s->state = SCAN_STRING;
+                    s->overflow = true; // Not worth trying to make sense of.
+                    break;
+                }
+                s->code = s->code * 16 + (isdigit((unsigned char)c) ?
+                        c - '0' : (c | 0x20) - 'a' + 10);
+                if (++s->code_digits == 4) {
+                    s->state = SCAN_STRING;
+                    if (s->code < 0x80) {
+                        scan_append(s, s->code);
+                    } else {
+                        s->overflow = true; // URLs should be plain ASCII.
+                    }
+                }
+                break;
+        }
+    }
+}
+
+/* Read in the image list, scanning it as we go.
+ *
+ * Like write_page, this aborts the transfer once we are done.
+ */
+size_t write_list(char* ptr, size_t size, size_t nmemb, void *data) {
+    Page* p = (Page*)data;
+
+    if (p->done) return 0;
+    scan_list(p, ptr, size * nmemb);
+    if (p->done) return 0; // Don't wait for another chunk to stop.
     return size * nmemb;
 }
 
+/* Return the URL of the mobile version of the given page.
+ *
+ * The caller should free the result. Returns NULL if the page has no mobile
+ * version (it isn't on DESKTOP_HOST), or on failure; either way the caller
+ * can just parse the page itself.
+ */
+char* mobile_url(char* url) {
+    char* host = strstr(url, DESKTOP_HOST);
+    char* result;
+    size_t len;
+
+    if (host == NULL) return NULL;
+    len = strlen(url) - strlen(DESKTOP_HOST) + strlen(MOBILE_HOST) + 1;
+    result = malloc(len);
+    if (result == NULL) return NULL;
+    snprintf(result, len, "%.*s%s%s", (int)(host - url), url, MOBILE_HOST,
+            host + strlen(DESKTOP_HOST));
+    return result;
+}
+
+/* Download the image list from the given URL and fetch the images in it.
+ *
+ * This is the fast path: the list is much smaller than the main page, and
+ * doesn't need to go through an HTML parser.
+ * The page should already be populated; "page->count" is left as the number
+ * of images found.
+ *
+ * Returns true on success, false otherwise.
+ */
+bool download_list(Page* page, char* list_url) {
+    CURL *curl;
+    CURLcode result;
+
+    memset(&page->scan, 0, sizeof(page->scan));
+    mem_subsystem_t previous = memstat_enter(MEM_CURL);
+    curl = get_handle(&page_curl);
+    if (!curl) {
+        memstat_leave(previous);
+        return false;
+    }
+
+    curl_easy_setopt(curl, CURLOPT_URL, list_url);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, MOBILE_USER_AGENT);
+    curl_easy_setopt(curl, CURLOPT_REFERER, page->url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_list);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, page);
+    result = curl_easy_perform(curl);
+    memstat_leave(previous);
+    if (result == CURLE_WRITE_ERROR && page->done) {
+        /* We stopped the transfer ourselves */
+    } else if (result != CURLE_OK) {
+        fprintf(stderr, "failed to retrieve %s: %s\n", list_url,
+                curl_easy_strerror(result));
+        return false;
+    }
+    return true;
+}
+
 /* Download the given URL and parse it with libhubbub.
+ *
+ * If "list_url" isn't NULL, try to get the images from the image list at
+ * that URL first.
  *
  * Returns true on success, false otherwise.
  */
-bool download_page(char* url, char* path) {
+bool download_page(char* url, char* path, unsigned int limit,
+        bool stop_at_end, char* list_url, char* store,
+        FILE* manifest, transcode_t* transcode) {
     CURL *curl;
     CURLcode result;
     Page page;
@@ -155,9 +591,31 @@ bool download_page(char* url, char* path) {
     page.url = url;
     page.path = path;
     page.count = 0;
+    page.limit = limit;
+    page.stop_at_end = stop_at_end;
+    page.depth = 0;
+    page.region_depth = -1;
+    page.done = false;
+    page.failed = false;
+    page.store = store;
+    page.manifest = manifest;
+    page.transcode = transcode;
+
+    if (list_url != NULL) {
+        if (download_list(&page, list_url) && page.count > 0) {
+            return !page.failed;
+        }
+        if (page.count > 0) return false; // Don't download images twice.
+        fprintf(stderr, "no images in %s, parsing the full page\n", list_url);
+        page.done = false;
+    }
+
+    mem_subsystem_t previous = memstat_enter(MEM_PARSER);
     if (hubbub_parser_create("UTF-8", false, &(page.parser)) != HUBBUB_OK) {
+        memstat_leave(previous);
         return false;
     }
+    memstat_leave(previous);
     params.token_handler.handler = token_handler;
     params.token_handler.pw = &page;
     if (hubbub_parser_setopt(page.parser, HUBBUB_PARSER_TOKEN_HANDLER,
@@ -166,8 +624,11 @@ bool download_page(char* url, char* path) {
     }
 
     /* Init curl */
-    curl = curl_easy_init();
+    memstat_enter(MEM_CURL);
+    curl = get_handle(&page_curl);
     if (!curl) {
+        hubbub_parser_destroy(page.parser);
+        memstat_leave(previous);
         return false;
     }
 
@@ -176,35 +637,42 @@ bool download_page(char* url, char* path) {
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_page);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &page);
     result = curl_easy_perform(curl);
-    if (result != CURLE_OK) {
+    if (result == CURLE_WRITE_ERROR && page.done) {
+        /* We stopped the transfer ourselves */
+    } else if (result != CURLE_OK) {
         fprintf(stderr, "failed to retrieve %s: %s\n", url,
                 curl_easy_strerror(result));
         ok = false;
     }
 
     /* Clean up */
+    memstat_enter(MEM_PARSER);
     hubbub_parser_destroy(page.parser);
-    curl_easy_cleanup(curl);
-    return ok;
+    memstat_leave(previous);
+    return ok && !page.failed;
 }
 
 void usage(char* name) {
     if (name == NULL) {
         name = "webtoon-scrape";
     }
-    fprintf(stderr, "usage: %s <url> [<path>]\n", name);
+    fprintf(stderr, "usage: %s [-n <count>] [-e] [-c <store>] [-w <width>] "
+            "[-f] [-j <list url>] <url> [<path>]\n", name);
 }
 
-int main(int argc, char** argv) {
+int run(int argc, char** argv) {
     char* path = "./";
     char* url = "";
+    unsigned int limit = 0;
+    bool stop_at_end = false;
+    char* store = NULL;
+    unsigned int width = 0;
+    bool fast = false;
+    char* list_url = NULL;
 
     if (argc == 0) {
         usage(NULL);
         return EXIT_FAILURE;
-    } else if (argc == 1 || argc > 3) {
-        usage(argv[0]);
-        return EXIT_FAILURE;
     }
 
     for (int i = 0; i < argc; i++) {
@@ -214,14 +682,86 @@ int main(int argc, char** argv) {
         }
     }
 
-    url = argv[1];
-    if (argc == 3) {
-        path = argv[2];
+    int opt;
+    while ((opt = getopt(argc, argv, "n:efj:c:w:")) != -1) {
+        if (opt == 'n') {
+            char* end;
+            limit = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || limit == 0) {
+                fprintf(stderr, "invalid count '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+        } else if (opt == 'e') {
+            stop_at_end = true;
+        } else if (opt == 'c') {
+            store = optarg;
+        } else if (opt == 'w') {
+            char* end;
+            width = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || width == 0) {
+                fprintf(stderr, "invalid width '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+        } else if (opt == 'f') {
+            fast = true;
+        } else if (opt == 'j') {
+            list_url = optarg;
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind < 1 || argc - optind > 2) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    url = argv[optind];
+    if (argc - optind == 2) {
+        path = argv[optind + 1];
     }
 
-    if (download_page(url, path)) {
-        return EXIT_SUCCESS;
-    } else {
+    char* mobile = NULL;
+    if (fast && list_url == NULL) {
+        /* Without a mobile version, go straight to parsing the page */
+        mobile = mobile_url(url);
+        list_url = mobile;
+    }
+
+    FILE* manifest = manifest_create(path, MANIFEST_NAME);
+    if (manifest == NULL) {
+        free(mobile);
         return EXIT_FAILURE;
     }
+
+    /* Transcode alongside the downloads if asked to */
+    transcode_t pool;
+    transcode_t* transcode = NULL;
+    if (width != 0) {
+        if (!transcode_start(&pool, width, path)) {
+            manifest_abort(manifest, path, MANIFEST_NAME);
+            free(mobile);
+            return EXIT_FAILURE;
+        }
+        transcode = &pool;
+    }
+    bool ok = download_page(url, path, limit, stop_at_end, list_url, store,
+            manifest, transcode);
+    if (transcode != NULL && !transcode_finish(transcode, ok)) ok = false;
+
+    /* Only replace the old manifest if we got the whole chapter */
+    if (!ok) {
+        manifest_abort(manifest, path, MANIFEST_NAME);
+    } else if (!manifest_commit(manifest, path, MANIFEST_NAME)) {
+        ok = false;
+    }
+    free(mobile);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0 && argc <= 3) {
+        return serve(argv[0], argv[2], run);
+    }
+    return run(argc, argv);
 }
@@ -0,0 +1,300 @@
+/* serve.h
+ *
+ * Resident service mode shared by the tools, and the protocol spoken with
+ * webutils-client.
+ *
+ * Running a tool as "<tool> --serve [<socket>]" makes it listen on a Unix
+ * socket instead, and run each connection as a separate invocation of the
+ * tool inside the same process. This avoids paying for process startup,
+ * dynamic linking and library setup on every run, and lets anything the tool
+ * keeps between runs (such as curl handles, and with them open connections)
+ * stay warm.
+ *
+ * A request is the client's working directory and the argument list, as
+ * null terminated strings followed by an empty string; the rest of the
+ * stream is the tool's stdin. The response is a series of frames, each a
+ * type byte and a 32 bit big endian length followed by that many bytes:
+ * stdout data, stderr data, and finally the exit status.
+ *
+ * Jobs are run one at a time, in the order they arrive.
+ *
+ * Jobs run as the server's user, in whatever directory the client asks for,
+ * so only the same user may connect: the socket is only accessible by us,
+ * the default one lives in a directory only we can get into, and both sides
+ * check who is on the other end.
+ *
+ * This needs _GNU_SOURCE (for struct ucred, and on the server side
+ * fopencookie and accept4), so define that before including anything else.
+ *
+ * Author:  Alastair Hughes
+ * Contact: hobbitalastair at yandex dot com
+ */
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#define SERVE_STDOUT '1' /* Frame containing stdout data */
+#define SERVE_STDERR '2' /* Frame containing stderr data */
+#define SERVE_EXIT 'x' /* Frame containing the 32 bit exit status */
+#define SERVE_REQUEST_MAX 65536 /* Maximum size of the request header */
+#define SERVE_MAX_ARGS 256 /* Maximum number of arguments in a request */
+
+bool serve_write_all(int fd, const void* data, size_t len) {
+    /* Write all of the given data to the fd.
+     *
+     * Return false on failure, true on success.
+     */
+    const char* p = data;
+    while (len > 0) {
+        ssize_t count = write(fd, p, len);
+        if (count == -1 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        p += count;
+        len -= count;
+    }
+    return true;
+}
+
+bool serve_write_frame(int fd, char type, const void* data, uint32_t len) {
+    /* Write a single response frame */
+    char header[5];
+    uint32_t be_len = htonl(len);
+    header[0] = type;
+    memcpy(header + 1, &be_len, sizeof(be_len));
+    return serve_write_all(fd, header, sizeof(header)) &&
+        serve_write_all(fd, data, len);
+}
+
+bool serve_socket_path(char* tool, char* path, size_t len) {
+    /* Find the default socket path for the given tool.
+     *
+     * Without XDG_RUNTIME_DIR this is in /tmp/webutils-<uid>, which is
+     * created if needed. That has to be our own directory which nobody else
+     * can write to, or another user could put their own server there.
+     *
+     * Return false with errno set if there is no safe path.
+     */
+    char dir[PATH_MAX];
+    char* runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime != NULL && runtime[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s", runtime);
+    } else {
+        struct stat st;
+        snprintf(dir, sizeof(dir), "/tmp/webutils-%lu",
+                (unsigned long)getuid());
+        if (mkdir(dir, 0700) == -1 && errno != EEXIST) return false;
+        if (lstat(dir, &st) == -1) return false;
+        if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+                (st.st_mode & 077) != 0) {
+            errno = EPERM;
+            return false;
+        }
+    }
+    char* base = strrchr(tool, '/');
+    base = base == NULL ? tool : base + 1;
+    if (snprintf(path, len, "%s/webutils-%s.sock", dir, base) >= (int)len) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    return true;
+}
+
+bool serve_same_user(int sock) {
+    /* Return true if the other end of the socket is running as us */
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+        cred.uid == getuid();
+}
+
+/* Everything past this point is only needed by the server side */
+#ifndef SERVE_CLIENT
+
+typedef struct {
+    int fd;
+    char type;
+} serve_stream_t;
+
+/* If set, called before waiting for each job, so that a tool can get ready
+ * for the next one without the client waiting on it.
+ */
+void (*serve_idle)(void) = NULL;
+
+ssize_t serve_stream_write(void* cookie, const char* data, size_t len) {
+    serve_stream_t* s = (serve_stream_t*)cookie;
+    if (!serve_write_frame(s->fd, s->type, data, len)) return -1;
+    return len;
+}
+
+bool serve_job(char* name, int conn, int (*run)(int, char**)) {
+    /* Read a request from the connection and run it.
+     *
+     * Return false if the request could not be run.
+     */
+    char request[SERVE_REQUEST_MAX];
+    char* args[SERVE_MAX_ARGS + 1];
+    int argc = -1; /* The first string is the working directory */
+    size_t start = 0;
+
+    /* Read the header a byte at a time, so that we don't eat any of the
+     * stdin data following it.
+     */
+    for (size_t i = 0; i < sizeof(request); i++) {
+        ssize_t count = read(conn, &request[i], 1);
+        if (count == -1 && errno == EINTR) {
+            i--;
+            continue;
+        }
+        if (count != 1) return false;
+        if (request[i] != '\0') continue;
+        if (i == start && argc >= 0) break; /* End of the arguments */
+        if (argc >= SERVE_MAX_ARGS) return false;
+        if (argc >= 0) args[argc] = &request[start];
+        argc++;
+        start = i + 1;
+    }
+    if (argc < 1) return false;
+    args[argc] = NULL;
+
+    /* Run the job from the client's directory, reading the connection as
+     * stdin and with stdout and stderr framed back to the client.
+     */
+    int cwd = open(".", O_RDONLY | O_DIRECTORY);
+    int saved_stdin = dup(0);
+    if (cwd == -1 || saved_stdin == -1 || chdir(request) == -1) {
+        fprintf(stderr, "%s: failed to set up job: %s\n", name,
+                strerror(errno));
+        if (cwd != -1) close(cwd);
+        if (saved_stdin != -1) close(saved_stdin);
+        return false;
+    }
+    dup2(conn, 0);
+
+    cookie_io_functions_t functions = {NULL, serve_stream_write, NULL, NULL};
+    serve_stream_t out_stream = {conn, SERVE_STDOUT};
+    serve_stream_t err_stream = {conn, SERVE_STDERR};
+    FILE* saved_stdout = stdout;
+    FILE* saved_stderr = stderr;
+    FILE* out = fopencookie(&out_stream, "w", functions);
+    FILE* err = fopencookie(&err_stream, "w", functions);
+    if (out != NULL && err != NULL) {
+        setvbuf(err, NULL, _IONBF, 0);
+        stdout = out;
+        stderr = err;
+
+        optind = 0; /* Reset getopt for the new argument list */
+        int status = run(argc, args);
+
+        fflush(stdout);
+        stdout = saved_stdout;
+        stderr = saved_stderr;
+        uint32_t be_status = htonl(status);
+        serve_write_frame(conn, SERVE_EXIT, &be_status, sizeof(be_status));
+    }
+    if (out != NULL) fclose(out);
+    if (err != NULL) fclose(err);
+
+    dup2(saved_stdin, 0);
+    close(saved_stdin);
+    if (fchdir(cwd) == -1) {
+        fprintf(stderr, "%s: fchdir(): %s\n", name, strerror(errno));
+    }
+    close(cwd);
+    return true;
+}
+
+int serve(char* name, char* path, int (*run)(int, char**)) {
+    /* Listen on the given socket path (or the default one for this tool, if
+     * NULL), running each connection as a job.
+     *
+     * This only returns on failure.
+     */
+    char default_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    if (path == NULL) {
+        if (!serve_socket_path(name, default_path, sizeof(default_path))) {
+            fprintf(stderr, "%s: no safe default socket path: %s\n", name,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+        path = default_path;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path '%s' is too long\n", name, path);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        fprintf(stderr, "%s: socket(): %s\n", name, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* Replace a stale socket, but never anything else at the path */
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s: %s exists and is not a socket\n", name,
+                    path);
+            close(sock);
+            return EXIT_FAILURE;
+        }
+        unlink(path);
+    }
+
+    /* Only we should be able to connect */
+    mode_t mask = umask(077);
+    int bound = bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+    if (bound == -1 || listen(sock, SOMAXCONN) == -1) {
+        fprintf(stderr, "%s: failed to listen on %s: %s\n", name, path,
+                strerror(errno));
+        close(sock);
+        return EXIT_FAILURE;
+    }
+
+    /* Clients going away shouldn't take the server with them */
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+        if (serve_idle != NULL) serve_idle();
+        int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "%s: accept(): %s\n", name, strerror(errno));
+            close(sock);
+            return EXIT_FAILURE;
+        }
+        if (!serve_same_user(conn)) {
+            fprintf(stderr, "%s: refusing a connection from another user\n",
+                    name);
+        } else if (!serve_job(name, conn, run)) {
+            fprintf(stderr, "%s: bad request\n", name);
+        }
+        close(conn);
+    }
+}
+
+#endif /* SERVE_CLIENT */
+#endif /* SERVE_H */
@@ -0,0 +1,152 @@
+/* sha256.h
+ *
+ * Small streaming SHA-256 implementation, so that we don't need to depend on
+ * a crypto library just to name files.
+ *
+ * Author:  Alastair Hughes
+ * Contact: hobbitalastair at yandex dot com
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SHA256_SIZE 32 /* Digest size in bytes */
+#define SHA256_HEX_SIZE (SHA256_SIZE * 2 + 1) /* Hex digest, with the null */
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length; /* Total bytes hashed */
+    uint8_t block[64]; /* Partial block */
+    size_t block_len;
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline void sha256_init(sha256_t* h) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f,
+        0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(h->state, initial, sizeof(initial));
+    h->length = 0;
+    h->block_len = 0;
+}
+
+static inline void sha256_block(sha256_t* h, const uint8_t* block) {
+    /* Process a single 64 byte block */
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4*i] << 24 | (uint32_t)block[4*i + 1] << 16 |
+            (uint32_t)block[4*i + 2] << 8 | block[4*i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^
+            (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^
+            (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h->state[0], b = h->state[1], c = h->state[2];
+    uint32_t d = h->state[3], e = h->state[4], f = h->state[5];
+    uint32_t g = h->state[6], k = h->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^
+            SHA256_ROTR(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = k + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^
+            SHA256_ROTR(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h->state[0] += a;
+    h->state[1] += b;
+    h->state[2] += c;
+    h->state[3] += d;
+    h->state[4] += e;
+    h->state[5] += f;
+    h->state[6] += g;
+    h->state[7] += k;
+}
+
+static inline void sha256_update(sha256_t* h, const void* data, size_t len) {
+    const uint8_t* p = data;
+    h->length += len;
+    while (len > 0) {
+        size_t n = 64 - h->block_len;
+        if (n > len) n = len;
+        memcpy(h->block + h->block_len, p, n);
+        h->block_len += n;
+        p += n;
+        len -= n;
+        if (h->block_len == 64) {
+            sha256_block(h, h->block);
+            h->block_len = 0;
+        }
+    }
+}
+
+static inline void sha256_final(sha256_t* h, uint8_t digest[SHA256_SIZE]) {
+    uint64_t bits = h->length * 8;
+    uint8_t pad = 0x80;
+    sha256_update(h, &pad, 1);
+    pad = 0;
+    while (h->block_len != 56) sha256_update(h, &pad, 1);
+    uint8_t length[8];
+    for (int i = 0; i < 8; i++) length[i] = bits >> (56 - 8 * i);
+    sha256_update(h, length, 8);
+    for (int i = 0; i < 8; i++) {
+        digest[4*i + 0] = h->state[i] >> 24;
+        digest[4*i + 1] = h->state[i] >> 16;
+        digest[4*i + 2] = h->state[i] >> 8;
+        digest[4*i + 3] = h->state[i];
+    }
+}
+
+static inline void sha256_hex(const uint8_t digest[SHA256_SIZE],
+        char hex[SHA256_HEX_SIZE]) {
+    for (int i = 0; i < SHA256_SIZE; i++) {
+        hex[2*i + 0] = "0123456789abcdef"[digest[i] >> 4];
+        hex[2*i + 1] = "0123456789abcdef"[digest[i] & 0xf];
+    }
+    hex[SHA256_HEX_SIZE - 1] = '\0';
+}
+
+static inline void sha256_string(const char* s, char hex[SHA256_HEX_SIZE]) {
+    /* Hash a whole string, giving the hex digest */
+    sha256_t h;
+    uint8_t digest[SHA256_SIZE];
+    sha256_init(&h);
+    sha256_update(&h, s, strlen(s));
+    sha256_final(&h, digest);
+    sha256_hex(digest, hex);
+}
+
+#endif /* SHA256_H */
@@ -0,0 +1,206 @@
+/* store.h
+ *
+ * Content-addressed image store, shared by the scrapers.
+ *
+ * Images are kept once in the store, named by the SHA-256 of their contents
+ * as <store>/<first two hex digits>/<rest>, and hardlinked into each chapter
+ * directory. This means the banners and end cards repeated in every chapter
+ * only take up space once.
+ *
+ * <store>/url/<SHA-256 of the url> is a symlink to the object for an image we
+ * have already downloaded, so known URLs are linked without fetching them
+ * again.
+ *
+ * The store has to be on the same filesystem as the chapter directories.
+ *
+ * Author:  Alastair Hughes
+ * Contact: hobbitalastair at yandex dot com
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <curl/curl.h>
+
+#include "manifest.h"
+#include "sha256.h"
+
+static inline bool store_mkdir(char* path) {
+    /* Create the given directory if it does not already exist */
+    if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+        fprintf(stderr, "failed to create %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static inline FILE* store_tmpfile(char* tmp) {
+    /* Create and open a file from the given mkstemp() template, with the
+     * permissions fopen() would have given it.
+     *
+     * Return NULL on failure.
+     */
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        fprintf(stderr, "failed to create %s: %s\n", tmp, strerror(errno));
+        return NULL;
+    }
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+    FILE* file = fdopen(fd, "w");
+    if (file == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+    }
+    return file;
+}
+
+static inline bool store_link(char* object, char* dest) {
+    /* Hardlink the given object (or symlink to one) to dest.
+     *
+     * Return false with errno set on failure.
+     */
+    if (unlink(dest) == -1 && errno != ENOENT) return false;
+    return linkat(AT_FDCWD, object, AT_FDCWD, dest, AT_SYMLINK_FOLLOW) == 0;
+}
+
+static inline bool store_index(char* url_path, char* hex) {
+    /* Point the url index entry at the object with the given hash */
+    char target[SHA256_HEX_SIZE + 4];
+    char tmp[PATH_MAX + 4];
+
+    snprintf(target, sizeof(target), "../%.2s/%s", hex, hex + 2);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", url_path);
+    if (unlink(tmp) == -1 && errno != ENOENT) return false;
+    if (symlink(target, tmp) == -1) return false;
+    if (rename(tmp, url_path) == -1) {
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+static inline bool store_lookup(char* url_path, char* dest,
+        manifest_entry_t* entry) {
+    /* Link an already indexed url to dest, filling in the manifest entry.
+     *
+     * Return false with errno set on failure.
+     */
+    char target[SHA256_HEX_SIZE + 4];
+    ssize_t len = readlink(url_path, target, sizeof(target));
+    if (len != 4 + SHA256_HEX_SIZE - 1) { /* "../hh/rest" */
+        /* Not one of ours (or not even a symlink), so treat it as missing;
+         * downloading it again replaces it.
+         */
+        if (len != -1 || errno == EINVAL) errno = ENOENT;
+        return false;
+    }
+    if (!store_link(url_path, dest)) return false;
+
+    /* The object is named by its checksum, so only sniff the dimensions */
+    snprintf(entry->sha256, sizeof(entry->sha256), "%.2s%.62s", target + 3,
+            target + 6);
+    if (!manifest_sniff_file(dest, entry)) return false;
+    return true;
+}
+
+/* Fetch the image at the given url into dest, through the store.
+ *
+ * The curl handle should be freshly reset; the referer may be NULL.
+ * The entry gets the image size, dimensions and checksum.
+ *
+ * Returns true on success, false otherwise.
+ */
+static inline bool store_fetch(CURL* curl, char* store, char* url,
+        char* referer, char* dest, manifest_entry_t* entry) {
+    char url_path[PATH_MAX];
+    char object[PATH_MAX];
+    char tmp[PATH_MAX];
+    char hex[SHA256_HEX_SIZE];
+    manifest_download_t d;
+    CURLcode result;
+
+    /* Link straight away if we have seen this url before */
+    sha256_string(url, hex);
+    if (snprintf(url_path, sizeof(url_path), "%s/url/%s", store, hex) >=
+            (int)sizeof(url_path)) {
+        fprintf(stderr, "store path %s is too long\n", store);
+        return false;
+    }
+    if (store_lookup(url_path, dest, entry)) return true;
+    if (errno != ENOENT) {
+        fprintf(stderr, "failed to link %s: %s\n", dest, strerror(errno));
+        return false;
+    }
+
+    /* Otherwise download into a temporary file in the store */
+    if (!store_mkdir(store)) return false;
+    snprintf(tmp, sizeof(tmp), "%s/tmp.XXXXXX", store);
+    d.file = store_tmpfile(tmp);
+    if (d.file == NULL) return false;
+    manifest_stream_init(&d.stream);
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, manifest_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &d);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    if (referer != NULL) curl_easy_setopt(curl, CURLOPT_REFERER, referer);
+    result = curl_easy_perform(curl);
+    if (fclose(d.file) != 0 && result == CURLE_OK) {
+        fprintf(stderr, "failed to write %s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return false;
+    }
+    if (result != CURLE_OK) {
+        fprintf(stderr, "failed to retrieve %s: %s\n", url,
+                curl_easy_strerror(result));
+        unlink(tmp);
+        return false;
+    }
+
+    /* Move it into place, unless we already have the same image */
+    manifest_stream_finish(&d.stream, entry);
+    memcpy(hex, entry->sha256, sizeof(hex));
+    snprintf(object, sizeof(object), "%s/%.2s", store, hex);
+    if (!store_mkdir(object)) {
+        unlink(tmp);
+        return false;
+    }
+    snprintf(object, sizeof(object), "%s/%.2s/%s", store, hex, hex + 2);
+    if (access(object, F_OK) == 0) {
+        unlink(tmp);
+    } else if (rename(tmp, object) == -1) {
+        fprintf(stderr, "failed to rename %s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return false;
+    }
+
+    if (!store_link(object, dest)) {
+        fprintf(stderr, "failed to link %s: %s\n", dest, strerror(errno));
+        return false;
+    }
+
+    /* A missing index entry only costs a download next time */
+    snprintf(object, sizeof(object), "%s/url", store);
+    if (store_mkdir(object)) {
+        if (!store_index(url_path, hex)) {
+            fprintf(stderr, "failed to index %s: %s\n", url, strerror(errno));
+        }
+    }
+    return true;
+}
+
+#endif /* STORE_H */
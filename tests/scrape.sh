@@ -0,0 +1,75 @@
+#!/bin/sh
+# Run the scrapers against the saved pages in tests/webtoon, served locally,
+# and check that they fetch just the comic's own images, in order.
+#
+# The scrapers to run can be set with WEBTOON and TAPAS (memcheck runs the
+# instrumented builds this way).
+#
+# For the image list paths (-f and -j), each page mentions "_imageList" and
+# then has some other list with a "url" in it, ahead of the real image list
+# (or instead of it, for the desktop page, where the list has to fall back to
+# parsing the page). The local pages aren't on www.webtoons.com, so -f has no
+# mobile page to try and parses them straight away. For -e and -n, each image on the page has a wrapper of
+# its own, and there is another image after the list; tapas.html is laid
+# out the same way, as tapas does it.
+
+webtoon="${WEBTOON:-./scrape-webtoon}"
+tapas="${TAPAS:-./scrape-tapas}"
+port="${TEST_PORT:-8731}"
+base="http://127.0.0.1:$port"
+dir="`mktemp -d`" || exit 1
+server=
+trap '[ -n "$server" ] && kill "$server"; rm -rf "$dir"' EXIT
+status=0
+
+mkdir "$dir/www"
+cp tests/webtoon/*.ff "$dir/www/"
+for page in tests/webtoon/*.html; do
+    sed "s|@BASE@|$base|g" "$page" > "$dir/www/${page##*/}"
+done
+python3 -m http.server --bind 127.0.0.1 --directory "$dir/www" "$port" \
+    > "$dir/server.log" 2>&1 &
+server=$!
+connect="import socket; socket.create_connection(('127.0.0.1', $port))"
+for try in 1 2 3 4 5 6 7 8 9 10; do
+    python3 -c "$connect" 2> /dev/null && break
+    sleep 0.2
+done
+
+check() {
+    # Run the scraper with the given arguments, and compare what it wrote
+    # against the first <count> of panel1.ff, panel2.ff and panel3.ff
+    name="$1"
+    count="$2"
+    scraper="$3"
+    shift 3
+    out="$dir/$name"
+    mkdir "$out"
+    if ! "$scraper" "$@" "$out" > /dev/null; then
+        echo "$name: $scraper failed"
+        status=1
+        return
+    fi
+    for i in `seq "$count"`; do
+        if ! cmp -s "$dir/www/panel$i.ff" "$out/00$((i - 1)).jpg"; then
+            echo "$name: image $((i - 1)) isn't panel$i.ff"
+            status=1
+        fi
+    done
+    if [ -e "$out/00$count.jpg" ] ||
+            [ "`wc -l < "$out/manifest"`" -ne "$count" ]; then
+        echo "$name: expected exactly $count images"
+        status=1
+    fi
+}
+
+check fast 3 "$webtoon" -f "$base/episode.html"
+check list 3 "$webtoon" -j "$base/mobile.html" "$base/episode.html"
+check fallback 3 "$webtoon" -j "$base/episode.html" "$base/episode.html"
+check end 3 "$webtoon" -e "$base/wrapped.html"
+check count 2 "$webtoon" -n 2 "$base/wrapped.html"
+check tapas-end 3 "$tapas" -e "$base/tapas.html"
+check tapas-count 2 "$tapas" -n 2 "$base/tapas.html"
+
+[ "$status" -eq 0 ] && echo "scrapers: ok"
+exit "$status"
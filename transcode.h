@@ -0,0 +1,359 @@
+/* transcode.h
+ *
+ * Background transcoding of downloaded images, shared by the scrapers.
+ *
+ * Each image is decoded once with TO_FARBFELD, shrunk to fit the configured
+ * width (averaging each block of pixels), and written next to the original
+ * as "%03d.ff" in plain farbfeld, and listed in the directory's
+ * MANIFEST_FF_NAME (see manifest.h). comic-viewer reads farbfeld files
+ * directly, so viewing these never needs a decoder.
+ *
+ * A small pool of threads does the work while the downloads carry on. The
+ * queue is bounded, so if decoding falls behind the downloads wait for it.
+ * Memory use is a few rows per worker, however large the images are.
+ *
+ * Author:  Alastair Hughes
+ * Contact: hobbitalastair at yandex dot com
+ */
+
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+
+#include "manifest.h"
+#include "memstat.h"
+
+#define TO_FARBFELD "/usr/bin/2ff" /* Helper program to convert to farbfeld */
+#define TRANSCODE_WORKERS 2 /* Number of transcoding threads */
+#define TRANSCODE_QUEUE 4 /* Maximum images waiting to be transcoded */
+#define TRANSCODE_STACK (256 * 1024) /* Worker thread stack size */
+
+extern char** environ;
+
+/* A single image to transcode */
+typedef struct {
+    char src[PATH_MAX + 1];
+    char dir[PATH_MAX + 1];
+    unsigned int index;
+} transcode_job_t;
+
+/* The transcoding pool */
+typedef struct {
+    unsigned int width; /* Width to shrink images to */
+    char* dir; /* Directory to write the manifest into */
+    FILE* manifest; /* Manifest of the transcoded images */
+    pthread_t threads[TRANSCODE_WORKERS];
+    int thread_count;
+
+    /* Everything below is protected by the lock */
+    pthread_mutex_t lock;
+    pthread_cond_t changed; /* Signalled when the queue changes */
+    transcode_job_t queue[TRANSCODE_QUEUE];
+    int head; /* Index of the next job to take */
+    int count; /* Number of jobs waiting */
+    bool closing; /* Set once no more jobs will be added */
+    bool failed; /* Set if any image failed */
+} transcode_t;
+
+static inline bool transcode_read(FILE* in, uint8_t* buf, size_t len) {
+    return fread(buf, 1, len, in) == len;
+}
+
+static inline bool transcode_write(FILE* out, manifest_stream_t* stream,
+        uint8_t* buf, size_t len) {
+    manifest_stream_update(stream, buf, len);
+    return fwrite(buf, 1, len, out) == len;
+}
+
+static inline bool transcode_scale(FILE* in, FILE* out,
+        manifest_stream_t* stream, unsigned int max_width) {
+    /* Read farbfeld from in, and write it to out shrunk to max_width.
+     *
+     * Each output pixel is the average of the block of input pixels which
+     * maps onto it, which we build up a row at a time.
+     *
+     * Return false on failure.
+     */
+    uint8_t header[16];
+    if (!transcode_read(in, header, sizeof(header)) ||
+            memcmp(header, "farbfeld", 8) != 0) {
+        return false;
+    }
+    uint32_t width = manifest_be32(header + 8);
+    uint32_t height = manifest_be32(header + 12);
+    uint32_t out_width = width < max_width ? width : max_width;
+    uint32_t out_height = width == 0 ? 0 :
+        ((uint64_t)height * out_width + width / 2) / width;
+    if (out_height == 0 && height != 0) out_height = 1;
+
+    uint32_t be[2] = {htonl(out_width), htonl(out_height)};
+    memcpy(header + 8, be, sizeof(be));
+    if (!transcode_write(out, stream, header, sizeof(header))) return false;
+    if (out_height == 0 || out_width == 0) return true;
+
+    uint8_t* row = malloc((size_t)width * 8);
+    uint8_t* out_row = malloc((size_t)out_width * 8);
+    uint64_t* sums = malloc((size_t)out_width * 4 * sizeof(uint64_t));
+    uint32_t* columns = malloc((size_t)out_width * sizeof(uint32_t));
+    bool ok = row != NULL && out_row != NULL && sums != NULL &&
+        columns != NULL;
+
+    /* Count the input columns going into each output column */
+    if (ok) {
+        memset(sums, 0, (size_t)out_width * 4 * sizeof(uint64_t));
+        memset(columns, 0, (size_t)out_width * sizeof(uint32_t));
+    }
+    for (uint32_t x = 0; ok && x < width; x++) {
+        columns[(uint64_t)x * out_width / width]++;
+    }
+
+    uint32_t rows = 0; /* Input rows summed so far for this output row */
+    for (uint32_t y = 0; ok && y < height; y++) {
+        if (!transcode_read(in, row, (size_t)width * 8)) {
+            ok = false;
+            break;
+        }
+        for (uint32_t x = 0; x < width; x++) {
+            uint64_t* sum = sums + ((uint64_t)x * out_width / width) * 4;
+            for (int c = 0; c < 4; c++) {
+                sum[c] += row[8*x + 2*c] << 8 | row[8*x + 2*c + 1];
+            }
+        }
+        rows++;
+
+        /* Write the output row once we have all of its input rows */
+        uint32_t out_y = (uint64_t)y * out_height / height;
+        if (y + 1 < height &&
+                (uint64_t)(y + 1) * out_height / height == out_y) {
+            continue;
+        }
+        for (uint32_t x = 0; x < out_width; x++) {
+            for (int c = 0; c < 4; c++) {
+                uint64_t count = (uint64_t)columns[x] * rows;
+                uint16_t v = count == 0 ? 0 : sums[4*x + c] / count;
+                out_row[8*x + 2*c] = v >> 8;
+                out_row[8*x + 2*c + 1] = v;
+            }
+        }
+        ok = transcode_write(out, stream, out_row, (size_t)out_width * 8);
+        memset(sums, 0, (size_t)out_width * 4 * sizeof(uint64_t));
+        rows = 0;
+    }
+
+    free(row);
+    free(out_row);
+    free(sums);
+    free(columns);
+    return ok;
+}
+
+static inline bool transcode_image(transcode_t* pool, transcode_job_t* job) {
+    /* Transcode a single image, adding it to the manifest.
+     *
+     * Return false on failure.
+     */
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 4];
+    manifest_entry_t entry;
+    manifest_stream_t stream;
+    int pipes[2];
+    pid_t child;
+
+    snprintf(entry.file, sizeof(entry.file), "%03u.ff", job->index);
+    if (snprintf(path, sizeof(path), "%s/%s", job->dir, entry.file) >=
+            (int)sizeof(path)) {
+        fprintf(stderr, "path %s is too long\n", job->dir);
+        return false;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    entry.index = job->index;
+
+    /* Start the helper, reading the image and writing to our pipe */
+    if (pipe2(pipes, O_CLOEXEC) == -1) {
+        fprintf(stderr, "failed to create pipe: %s\n", strerror(errno));
+        return false;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, job->src, O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, pipes[1], 1);
+    char* argv[] = {TO_FARBFELD, NULL};
+    int err = posix_spawn(&child, TO_FARBFELD, &actions, NULL, argv,
+            environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipes[1]);
+    if (err != 0) {
+        fprintf(stderr, "failed to run %s: %s\n", TO_FARBFELD,
+                strerror(err));
+        close(pipes[0]);
+        return false;
+    }
+
+    FILE* in = fdopen(pipes[0], "r");
+    FILE* out = fopen(tmp, "w");
+    bool ok = in != NULL && out != NULL;
+    if (!ok) {
+        fprintf(stderr, "failed to open %s: %s\n", tmp, strerror(errno));
+    } else {
+        manifest_stream_init(&stream);
+        ok = transcode_scale(in, out, &stream, pool->width);
+        if (!ok) fprintf(stderr, "failed to transcode %s\n", job->src);
+    }
+    if (in != NULL) {
+        fclose(in);
+    } else {
+        close(pipes[0]);
+    }
+    if (out != NULL && fclose(out) != 0 && ok) {
+        fprintf(stderr, "failed to write %s: %s\n", tmp, strerror(errno));
+        ok = false;
+    }
+
+    int status;
+    if (waitpid(child, &status, 0) != child || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != EXIT_SUCCESS) {
+        if (ok) fprintf(stderr, "%s failed on %s\n", TO_FARBFELD,
+                job->src);
+        ok = false;
+    }
+    if (ok && rename(tmp, path) == -1) {
+        fprintf(stderr, "failed to rename %s: %s\n", tmp, strerror(errno));
+        ok = false;
+    }
+    if (!ok) {
+        unlink(tmp);
+        return false;
+    }
+
+    /* Single stdio calls are atomic, so we can share the manifest */
+    manifest_stream_finish(&stream, &entry);
+    manifest_add(pool->manifest, &entry);
+    return true;
+}
+
+static inline void* transcode_worker(void* data) {
+    /* Take jobs from the queue until it is closed and empty */
+    transcode_t* pool = (transcode_t*)data;
+    transcode_job_t job;
+
+    memstat_enter(MEM_CACHE);
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->count == 0 && !pool->closing) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        if (pool->count == 0) break;
+        job = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % TRANSCODE_QUEUE;
+        pool->count--;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+
+        bool ok = transcode_image(pool, &job);
+
+        pthread_mutex_lock(&pool->lock);
+        if (!ok) pool->failed = true;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Start the transcoding pool, shrinking images to the given width and
+ * listing them in a new MANIFEST_FF_NAME in "dir".
+ *
+ * Returns true on success, false otherwise.
+ */
+static inline bool transcode_start(transcode_t* pool, unsigned int width,
+        char* dir) {
+    pthread_attr_t attr;
+
+    pool->width = width;
+    pool->dir = dir;
+    pool->manifest = manifest_create(dir, MANIFEST_FF_NAME);
+    if (pool->manifest == NULL) return false;
+    pool->thread_count = 0;
+    pool->head = 0;
+    pool->count = 0;
+    pool->closing = false;
+    pool->failed = false;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->changed, NULL);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, TRANSCODE_STACK);
+    for (int i = 0; i < TRANSCODE_WORKERS; i++) {
+        int err = pthread_create(&pool->threads[i], &attr, transcode_worker,
+                pool);
+        if (err != 0) {
+            fprintf(stderr, "failed to start transcoder: %s\n",
+                    strerror(err));
+            break;
+        }
+        pool->thread_count++;
+    }
+    pthread_attr_destroy(&attr);
+    if (pool->thread_count == 0) {
+        manifest_abort(pool->manifest, dir, MANIFEST_FF_NAME);
+        return false;
+    }
+    return true;
+}
+
+/* Queue the given image for transcoding into "<dir>/<index>.ff".
+ *
+ * This blocks while the queue is full.
+ */
+static inline void transcode_add(transcode_t* pool, char* src, char* dir,
+        unsigned int index) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == TRANSCODE_QUEUE) {
+        pthread_cond_wait(&pool->changed, &pool->lock);
+    }
+    transcode_job_t* job =
+        &pool->queue[(pool->head + pool->count) % TRANSCODE_QUEUE];
+    snprintf(job->src, sizeof(job->src), "%s", src);
+    snprintf(job->dir, sizeof(job->dir), "%s", dir);
+    job->index = index;
+    pool->count++;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Wait for everything queued to be transcoded, stop the pool and write out
+ * its manifest.
+ *
+ * The manifest is only kept if "ok" (the caller's own work went fine) and
+ * every image was transcoded; otherwise any old one is left as it was.
+ * Returns false if any image failed, true otherwise.
+ */
+static inline bool transcode_finish(transcode_t* pool, bool ok) {
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = true;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->changed);
+    if (!ok || pool->failed) {
+        manifest_abort(pool->manifest, pool->dir, MANIFEST_FF_NAME);
+        return false;
+    }
+    return manifest_commit(pool->manifest, pool->dir, MANIFEST_FF_NAME);
+}
+
+#endif /* TRANSCODE_H */
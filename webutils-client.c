@@ -0,0 +1,180 @@
+/* webutils-client.c
+ *
+ * Run a tool through its resident server (see serve.h).
+ *
+ * "webutils-client <tool> <args> ..." behaves exactly like running
+ * "<tool> <args> ..." directly: stdin is passed through, and stdout, stderr
+ * and the exit status come back from the server. If there is no server
+ * running for the tool, the tool is run directly instead.
+ *
+ * The socket path can be overridden with WEBUTILS_SOCKET. A server running
+ * as another user is treated as if there were no server.
+ *
+ * Author:  Alastair Hughes
+ * Contact: hobbitalastair at yandex dot com
+ */
+
+#define _GNU_SOURCE /* For struct ucred */
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SERVE_CLIENT
+#include "serve.h"
+
+#define BUF_SIZE 4096
+
+char* name = __FILE__;
+
+int connect_server(char* tool) {
+    /* Connect to the server for the given tool.
+     *
+     * Return the socket, or -1 on failure.
+     */
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (getenv("WEBUTILS_SOCKET") != NULL) {
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s",
+                getenv("WEBUTILS_SOCKET"));
+    } else if (!serve_socket_path(tool, addr.sun_path,
+                sizeof(addr.sun_path))) {
+        return -1;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) return -1;
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+            !serve_same_user(sock)) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+bool send_request(int sock, int argc, char** argv) {
+    /* Send the working directory and arguments */
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        fprintf(stderr, "%s: getcwd(): %s\n", name, strerror(errno));
+        return false;
+    }
+    if (!serve_write_all(sock, cwd, strlen(cwd) + 1)) return false;
+    for (int i = 0; i < argc; i++) {
+        if (!serve_write_all(sock, argv[i], strlen(argv[i]) + 1)) {
+            return false;
+        }
+    }
+    return serve_write_all(sock, "", 1);
+}
+
+int run_remote(int sock) {
+    /* Pass stdin to the server while writing out the frames coming back.
+     *
+     * Both directions are handled together, since the tool may start
+     * writing output before it has read all of its input.
+     *
+     * Return the exit status.
+     */
+    char buf[BUF_SIZE];
+    char header[5];
+    size_t header_len = 0; /* Bytes of the current frame header so far */
+    uint32_t remaining = 0; /* Bytes left in the current frame */
+    bool sending = true;
+
+    while (1) {
+        struct pollfd fds[2] = {
+            {sock, POLLIN, 0},
+            {0, POLLIN, 0},
+        };
+        if (poll(fds, sending ? 2 : 1, -1) == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "%s: poll(): %s\n", name, strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        if (sending && fds[1].revents != 0) {
+            ssize_t count = read(0, buf, sizeof(buf));
+            if (count > 0 && !serve_write_all(sock, buf, count)) {
+                /* The tool doesn't want any more input */
+                count = 0;
+            }
+            if (count <= 0) {
+                shutdown(sock, SHUT_WR);
+                sending = false;
+            }
+        }
+
+        if (fds[0].revents == 0) continue;
+        if (header_len < sizeof(header)) {
+            ssize_t count = read(sock, header + header_len,
+                    sizeof(header) - header_len);
+            if (count <= 0) break;
+            header_len += count;
+            if (header_len == sizeof(header)) {
+                memcpy(&remaining, header + 1, sizeof(remaining));
+                remaining = ntohl(remaining);
+            }
+        } else if (header[0] == SERVE_EXIT) {
+            uint32_t status;
+            char* p = (char*)&status;
+            size_t got = 0;
+            while (got < sizeof(status)) {
+                ssize_t count = read(sock, p + got, sizeof(status) - got);
+                if (count <= 0) break;
+                got += count;
+            }
+            if (got != sizeof(status)) break;
+            return ntohl(status);
+        } else {
+            size_t len = remaining < sizeof(buf) ? remaining : sizeof(buf);
+            ssize_t count = read(sock, buf, len);
+            if (count <= 0) break;
+            int fd = header[0] == SERVE_STDERR ? 2 : 1;
+            if (!serve_write_all(fd, buf, count)) return EXIT_FAILURE;
+            remaining -= count;
+        }
+        if (header_len == sizeof(header) && remaining == 0 &&
+                header[0] != SERVE_EXIT) {
+            header_len = 0;
+        }
+    }
+
+    fprintf(stderr, "%s: lost connection to the server\n", name);
+    return EXIT_FAILURE;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 0) name = argv[0];
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <tool> [<args> ...]\n", name);
+        return EXIT_FAILURE;
+    }
+
+    int sock = connect_server(argv[1]);
+    if (sock == -1) {
+        execvp(argv[1], &argv[1]);
+        fprintf(stderr, "%s: execvp(%s): %s\n", name, argv[1],
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* We handle a closed connection ourselves */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!send_request(sock, argc - 1, &argv[1])) {
+        fprintf(stderr, "%s: failed to send request\n", name);
+        return EXIT_FAILURE;
+    }
+    return run_remote(sock);
+}